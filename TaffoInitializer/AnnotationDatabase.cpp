@@ -0,0 +1,311 @@
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/MathExtras.h"
+#include "AnnotationDatabase.h"
+
+
+using namespace llvm;
+using namespace taffo;
+using namespace mdutils;
+
+
+static const char DatabaseMagic[4] = {'T', 'A', 'D', 'B'};
+static const uint32_t DatabaseVersion = 1;
+static const size_t HeaderSize = 12;
+static const size_t IndexEntrySize = 16;
+
+enum RecordFlags : uint8_t {
+  StartingPoint = 1,
+  Backtracking = 2,
+  HasTarget = 4
+};
+
+enum MetadataTag : uint8_t {
+  NoMetadata = 0,
+  ScalarMetadata = 1,
+  StructMetadata = 2
+};
+
+enum ScalarFlags : uint8_t {
+  HasType = 1,
+  SignedType = 2,
+  HasRange = 4,
+  HasError = 8,
+  EnableConversion = 16,
+  Final = 32,
+  Declaration = 64
+};
+
+
+static void encodeMetadata(support::endian::Writer& w, const MDInfo *md)
+{
+  if (!md) {
+    w.write<uint8_t>(NoMetadata);
+
+  } else if (const InputInfo *ii = dyn_cast<InputInfo>(md)) {
+    const FPType *fpt = dyn_cast_or_null<FPType>(ii->IType.get());
+    uint8_t flags = 0;
+    if (fpt)
+      flags |= HasType | (fpt->isSigned() ? SignedType : 0);
+    if (ii->IRange)
+      flags |= HasRange;
+    if (ii->IError)
+      flags |= HasError;
+    if (ii->IEnableConversion)
+      flags |= EnableConversion;
+    if (ii->IFinal)
+      flags |= Final;
+    if (ii->IDeclaration)
+      flags |= Declaration;
+    w.write<uint8_t>(ScalarMetadata);
+    w.write<uint8_t>(flags);
+    if (fpt) {
+      w.write<uint32_t>(fpt->getWidth());
+      w.write<uint32_t>(fpt->getPointPos());
+    }
+    if (ii->IRange) {
+      w.write<uint64_t>(DoubleToBits(ii->IRange->Min));
+      w.write<uint64_t>(DoubleToBits(ii->IRange->Max));
+    }
+    if (ii->IError)
+      w.write<uint64_t>(DoubleToBits(*ii->IError));
+    w.write<int32_t>(ii->location);
+
+  } else if (const StructInfo *si = dyn_cast<StructInfo>(md)) {
+    w.write<uint8_t>(StructMetadata);
+    w.write<uint32_t>(si->size());
+    for (unsigned i = 0; i < si->size(); i++)
+      encodeMetadata(w, si->getField(i).get());
+  }
+}
+
+
+namespace {
+
+/* Bounds-checked cursor over a record */
+struct RecordReader {
+  const char *p;
+  const char *end;
+
+  bool need(size_t n) const { return (size_t)(end - p) >= n; };
+  bool readU8(uint8_t& v) {
+    if (!need(1)) return false;
+    v = *p++;
+    return true;
+  };
+  bool readU32(uint32_t& v) {
+    if (!need(4)) return false;
+    v = support::endian::read32le(p);
+    p += 4;
+    return true;
+  };
+  bool readDouble(double& v) {
+    if (!need(8)) return false;
+    v = BitsToDouble(support::endian::read64le(p));
+    p += 8;
+    return true;
+  };
+};
+
+}
+
+
+static bool decodeMetadata(RecordReader& r, std::shared_ptr<MDInfo>& md, unsigned depth = 0)
+{
+  uint8_t tag;
+  if (depth > 64 || !r.readU8(tag))
+    return false;
+
+  if (tag == NoMetadata) {
+    md.reset();
+    return true;
+
+  } else if (tag == ScalarMetadata) {
+    uint8_t flags;
+    if (!r.readU8(flags))
+      return false;
+    InputInfo *ii = new InputInfo(nullptr, nullptr, nullptr, flags & EnableConversion);
+    md.reset(ii);
+    if (flags & HasType) {
+      uint32_t width, pointPos;
+      if (!r.readU32(width) || !r.readU32(pointPos))
+        return false;
+      ii->IType.reset(new FPType(width, pointPos, flags & SignedType));
+    }
+    if (flags & HasRange) {
+      ii->IRange.reset(new Range());
+      if (!r.readDouble(ii->IRange->Min) || !r.readDouble(ii->IRange->Max))
+        return false;
+    }
+    if (flags & HasError) {
+      ii->IError = std::make_shared<double>(0);
+      if (!r.readDouble(*ii->IError))
+        return false;
+    }
+    ii->IFinal = flags & Final;
+    ii->IDeclaration = flags & Declaration;
+    uint32_t location;
+    if (!r.readU32(location))
+      return false;
+    ii->location = (int32_t)location;
+    return true;
+
+  } else if (tag == StructMetadata) {
+    uint32_t n;
+    if (!r.readU32(n) || n == 0 || !r.need(n))
+      return false;
+    std::vector<std::shared_ptr<MDInfo>> fields(n);
+    for (uint32_t i = 0; i < n; i++) {
+      if (!decodeMetadata(r, fields[i], depth + 1))
+        return false;
+    }
+    md.reset(new StructInfo(fields));
+    return true;
+  }
+  return false;
+}
+
+
+bool AnnotationDatabaseBuilder::add(StringRef key, const ParsedAnnotation& ann)
+{
+  std::string rec;
+  raw_string_ostream os(rec);
+  support::endian::Writer w(os, support::little);
+  uint8_t flags = 0;
+  if (ann.startingPoint)
+    flags |= StartingPoint;
+  if (ann.backtracking)
+    flags |= Backtracking;
+  if (ann.target.hasValue())
+    flags |= HasTarget;
+  w.write<uint8_t>(flags);
+  w.write<uint32_t>(ann.backtrackingDepth);
+  if (ann.target.hasValue()) {
+    w.write<uint32_t>(ann.target->size());
+    os << *ann.target;
+  }
+  encodeMetadata(w, ann.metadata.get());
+  os.flush();
+  return records.insert(std::make_pair(key.str(), std::move(rec))).second;
+}
+
+
+void AnnotationDatabaseBuilder::write(raw_ostream& os) const
+{
+  support::endian::Writer w(os, support::little);
+  os.write(DatabaseMagic, sizeof(DatabaseMagic));
+  w.write<uint32_t>(DatabaseVersion);
+  w.write<uint32_t>(records.size());
+
+  uint32_t off = HeaderSize + IndexEntrySize * records.size();
+  for (auto& rec: records) {
+    w.write<uint32_t>(off);
+    w.write<uint32_t>(rec.first.size());
+    off += rec.first.size();
+    w.write<uint32_t>(off);
+    w.write<uint32_t>(rec.second.size());
+    off += rec.second.size();
+  }
+  for (auto& rec: records)
+    os << rec.first << rec.second;
+}
+
+
+std::unique_ptr<AnnotationDatabase> AnnotationDatabase::open(StringRef filename, std::string& err)
+{
+  /* Without the null terminator requirement the file is mapped instead of
+   * being read */
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(filename, -1, false);
+  if (!buf) {
+    err = buf.getError().message();
+    return nullptr;
+  }
+  const char *p = (*buf)->getBufferStart();
+  size_t size = (*buf)->getBufferSize();
+  if (size < HeaderSize || StringRef(p, 4) != StringRef(DatabaseMagic, 4)) {
+    err = "not an annotation database";
+    return nullptr;
+  }
+  if (support::endian::read32le(p + 4) != DatabaseVersion) {
+    err = "unsupported annotation database version";
+    return nullptr;
+  }
+  uint32_t count = support::endian::read32le(p + 8);
+  if ((size - HeaderSize) / IndexEntrySize < count) {
+    err = "truncated annotation database";
+    return nullptr;
+  }
+  /* Check the index once, so that lookups can trust it */
+  for (uint32_t i = 0; i < count; i++) {
+    const char *entry = p + HeaderSize + IndexEntrySize * i;
+    for (unsigned j = 0; j < 4; j += 2) {
+      uint64_t off = support::endian::read32le(entry + 4 * j);
+      uint64_t len = support::endian::read32le(entry + 4 * j + 4);
+      if (off + len > size) {
+        err = "corrupted annotation database index";
+        return nullptr;
+      }
+    }
+  }
+
+  std::unique_ptr<AnnotationDatabase> db(new AnnotationDatabase(std::move(*buf)));
+  db->index = p + HeaderSize;
+  db->count = count;
+  return db;
+}
+
+
+StringRef AnnotationDatabase::getKey(uint32_t i) const
+{
+  const char *entry = index + IndexEntrySize * i;
+  return StringRef(buffer->getBufferStart() + support::endian::read32le(entry),
+                   support::endian::read32le(entry + 4));
+}
+
+
+uint32_t AnnotationDatabase::lowerBound(StringRef key) const
+{
+  uint32_t lo = 0, hi = count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (getKey(mid) < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+
+bool AnnotationDatabase::hasKeyWithPrefix(StringRef prefix) const
+{
+  uint32_t i = lowerBound(prefix);
+  return i < count && getKey(i).startswith(prefix);
+}
+
+
+bool AnnotationDatabase::lookup(StringRef key, ParsedAnnotation& res) const
+{
+  uint32_t i = lowerBound(key);
+  if (i >= count || getKey(i) != key)
+    return false;
+
+  const char *entry = index + IndexEntrySize * i;
+  const char *rec = buffer->getBufferStart() + support::endian::read32le(entry + 8);
+  RecordReader r{rec, rec + support::endian::read32le(entry + 12)};
+  uint8_t flags;
+  uint32_t depth;
+  if (!r.readU8(flags) || !r.readU32(depth))
+    return false;
+  res.startingPoint = flags & StartingPoint;
+  res.backtracking = flags & Backtracking;
+  res.backtrackingDepth = depth;
+  res.target.reset();
+  if (flags & HasTarget) {
+    uint32_t len;
+    if (!r.readU32(len) || !r.need(len))
+      return false;
+    res.target = std::string(r.p, len);
+    r.p += len;
+  }
+  return decodeMetadata(r, res.metadata);
+}
@@ -0,0 +1,74 @@
+#include <map>
+#include <memory>
+#include <string>
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "AnnotationParser.h"
+
+
+#ifndef __TAFFO_ANNOTATION_DATABASE_H__
+#define __TAFFO_ANNOTATION_DATABASE_H__
+
+
+namespace taffo {
+
+
+/* Precompiled annotations, applied without any annotate() attribute in the
+ * source (-taffo-init-annotation-db). Each entry maps the key of a value to
+ * its already parsed annotation. Keys are
+ *   @name          a global variable or a function
+ *   function:var   a local variable, by debug info name or alloca name
+ *   function@line  a local variable, by debug info declaration line
+ *
+ * The database is a little-endian binary file, mapped in memory and never
+ * decoded as a whole:
+ *   "TADB" version:u32 count:u32
+ *   count x (keyOff:u32 keyLen:u32 recOff:u32 recLen:u32), sorted by key
+ *   key and record data
+ * A record is
+ *   flags:u8 backtrackingDepth:u32 [targetLen:u32 target] metadata
+ * and the metadata is a tagged tree:
+ *   0                        none
+ *   1 flags:u8 [width:u32 pointPos:u32] [min:f64 max:f64] [error:f64]
+ *     location:i32           scalar
+ *   2 count:u32 fields       struct */
+class AnnotationDatabase {
+public:
+  static std::unique_ptr<AnnotationDatabase> open(llvm::StringRef filename, std::string& err);
+
+  /* Decode the annotation with the given key into res. The metadata is
+   * freshly allocated at every lookup. */
+  bool lookup(llvm::StringRef key, ParsedAnnotation& res) const;
+  /* Whether any key starts with prefix */
+  bool hasKeyWithPrefix(llvm::StringRef prefix) const;
+  uint32_t size() const { return count; };
+
+private:
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  const char *index = nullptr;
+  uint32_t count = 0;
+
+  AnnotationDatabase(std::unique_ptr<llvm::MemoryBuffer> buf): buffer(std::move(buf)) { }
+  llvm::StringRef getKey(uint32_t i) const;
+  uint32_t lowerBound(llvm::StringRef key) const;
+};
+
+
+class AnnotationDatabaseBuilder {
+public:
+  /* Returns false if the key was already added */
+  bool add(llvm::StringRef key, const ParsedAnnotation& ann);
+  void write(llvm::raw_ostream& os) const;
+  size_t size() const { return records.size(); };
+
+private:
+  /* Encoded records, sorted by key */
+  std::map<std::string, std::string> records;
+};
+
+
+}
+
+
+#endif // __TAFFO_ANNOTATION_DATABASE_H__
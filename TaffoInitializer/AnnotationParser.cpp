@@ -2,6 +2,8 @@
 #include <climits>
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "AnnotationParser.h"
 
 
@@ -16,6 +18,7 @@ void AnnotationParser::reset()
   startingPoint = false;
   backtracking = false;
   metadata.reset();
+  definedProfile = None;
 }
 
 
@@ -127,7 +130,9 @@ bool AnnotationParser::parseNewSyntax()
 
     } else if (peek("backtracking")) {
       if (peek("(")) {
-        if (!expectBoolean(backtracking)) {
+        if (expectBoolean(backtracking)) {
+          backtrackingDepth = backtracking ? UINT_MAX : 0;
+        } else {
           int64_t tmp;
           if (!expectInteger(tmp)) return false;
           backtrackingDepth = tmp;
@@ -144,6 +149,16 @@ bool AnnotationParser::parseNewSyntax()
       
     } else if (peek("scalar")) {
       if (!parseScalar(metadata)) return false;
+
+    } else if (peek("profile")) {
+      if (!applyProfile(metadata)) return false;
+
+    } else if (peek("define_profile")) {
+      std::string name;
+      if (!expect("(")) return false;
+      if (!expectString(name)) return false;
+      if (!expect(")")) return false;
+      definedProfile = name;
     } else {
       error = "Unknown identifier at character index " + std::to_string(sstream.tellg());
       return false;
@@ -252,6 +267,11 @@ bool AnnotationParser::parseStruct(std::shared_ptr<MDInfo>& thisMd)
       if (!parseStruct(tmp)) return false;
       elems.push_back(tmp);
       
+    } else if (peek("profile")) {
+      std::shared_ptr<MDInfo> tmp;
+      if (!applyProfile(tmp)) return false;
+      elems.push_back(tmp);
+      
     } else if (peek("void")) {
       elems.push_back(nullptr);
       
@@ -271,6 +291,89 @@ bool AnnotationParser::parseStruct(std::shared_ptr<MDInfo>& thisMd)
 }
 
 
+/* profile('name'): the content of the profile replaces thisMd, while the
+ * target and the backtracking of the profile apply only at the top level
+ * and only when the annotation does not specify them */
+bool AnnotationParser::applyProfile(std::shared_ptr<MDInfo>& thisMd)
+{
+  std::string name;
+  if (!expect("(")) return false;
+  if (!expectString(name)) return false;
+  if (!expect(")")) return false;
+
+  if (thisMd.get() != nullptr) {
+    error = "Duplicated content definition in this context";
+    return false;
+  }
+  const ParsedAnnotation *profile = profiles ? profiles->lookup(name) : nullptr;
+  if (!profile) {
+    error = "Unknown profile '" + name + "'";
+    return false;
+  }
+  thisMd = copyAnnotationMetadata(profile->metadata.get());
+
+  if (&thisMd != &metadata)
+    return true;
+  if (profile->target.hasValue() && !target.hasValue()) {
+    target = profile->target;
+    startingPoint |= profile->startingPoint;
+  }
+  if (profile->backtracking && !backtracking) {
+    backtracking = true;
+    backtrackingDepth = profile->backtrackingDepth;
+  }
+  return true;
+}
+
+
+std::shared_ptr<MDInfo> taffo::copyAnnotationMetadata(const MDInfo *md)
+{
+  if (!md)
+    return nullptr;
+  if (const StructInfo *si = dyn_cast<StructInfo>(md)) {
+    std::vector<std::shared_ptr<MDInfo>> fields;
+    for (unsigned i = 0; i < si->size(); i++)
+      fields.push_back(copyAnnotationMetadata(si->getField(i).get()));
+    return std::make_shared<StructInfo>(fields);
+  }
+  const InputInfo *ii = cast<InputInfo>(md);
+  InputInfo *res = cast<InputInfo>(ii->clone());
+  res->IDeclaration = ii->IDeclaration;
+  res->location = ii->location;
+  return std::shared_ptr<MDInfo>(res);
+}
+
+
+bool AnnotationProfileTable::define(StringRef name, StringRef annotation, std::string& err)
+{
+  AnnotationParser parser(this);
+  if (!parser.parseAnnotationString(annotation)) {
+    err = parser.lastError().str();
+    return false;
+  }
+  insert(name, parser);
+  return true;
+}
+
+
+bool AnnotationProfileTable::readFile(StringRef filename, std::string& err)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(filename);
+  if (!buf) {
+    err = buf.getError().message();
+    return false;
+  }
+  for (line_iterator line(**buf, true, '#'); !line.is_at_eof(); ++line) {
+    std::pair<StringRef, StringRef> fields = line->trim().split(' ');
+    if (!define(fields.first, fields.second.trim(), err)) {
+      err = filename.str() + ":" + std::to_string(line.line_number()) + ": " + err;
+      return false;
+    }
+  }
+  return true;
+}
+
+
 char AnnotationParser::skipWhitespace()
 {
   char tmp = '\0';
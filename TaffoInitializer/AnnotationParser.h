@@ -11,12 +11,14 @@
 namespace taffo {
 
 
-class AnnotationParser {
+class AnnotationParser: public ParsedAnnotation {
   std::istringstream sstream;
   std::string nextToken;
   std::string error;
+  const AnnotationProfileTable *profiles;
   
   void reset();
+  bool applyProfile(std::shared_ptr<mdutils::MDInfo>& thisMd);
   
   bool parseOldSyntax();
   
@@ -41,12 +43,10 @@ class AnnotationParser {
   bool expectBoolean(bool& res);
   
 public:
-  llvm::Optional<std::string> target;
-  bool startingPoint;
-  bool backtracking;
-  unsigned int backtrackingDepth;
-  std::shared_ptr<mdutils::MDInfo> metadata;
-  
+  /* Name of the profile defined by a define_profile() annotation */
+  llvm::Optional<std::string> definedProfile;
+
+  AnnotationParser(const AnnotationProfileTable *profiles = nullptr): profiles(profiles) { }
   bool parseAnnotationString(llvm::StringRef annString);
   llvm::StringRef lastError();
 };
@@ -1,3 +1,4 @@
+#include <cmath>
 #include <sstream>
 #include <iostream>
 #include "llvm/Pass.h"
@@ -6,27 +7,22 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Support/raw_ostream.h"
 #include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
 #include "AnnotationParser.h"
+#include "AnnotationDatabase.h"
 #include "Metadata.h"
 #include "TypeUtils.h"
-#include <iostream>
-#include <fstream>
-#include <sstream>
 
 using namespace llvm;
 using namespace taffo;
 using namespace std;
 using namespace mdutils;
 
-llvm::cl::opt<int> FracThreshold2("minfractbits2", llvm::cl::value_desc("bits"),
-    llvm::cl::desc("Threshold of fractional bits in fixed point numbers"), llvm::cl::init(3));
-llvm::cl::opt<int> TotalBits2("totalbits2", llvm::cl::value_desc("bits"),
-    llvm::cl::desc("Total amount of bits in fixed point numbers"), llvm::cl::init(32));
-
-
 void TaffoInitializer::readGlobalAnnotations(Module &m,
     MultiValueMap<Value *, ValueInfo>& variables,
 		bool functionAnnotation)
@@ -77,7 +73,7 @@ void TaffoInitializer::readLocalAnnotations(llvm::Function &f, MultiValueMap<Val
       }
     }
   }
-  if (found) {
+  if (found && !options.estimateOnly) {
     mdutils::MetadataManager::setStartingPoint(f);
   }
 }
@@ -86,58 +82,226 @@ void TaffoInitializer::readLocalAnnotations(llvm::Function &f, MultiValueMap<Val
 void TaffoInitializer::readAllLocalAnnotations(llvm::Module &m, MultiValueMap<Value *, ValueInfo>& res)
 {
   for (Function &f: m.functions()) {
-    MultiValueMap<Value *, ValueInfo> t;
-    readLocalAnnotations(f, t);
-    res.insert(res.end(), t.begin(), t.end());
+    /* In lazily loaded modules the functions without local annotations
+     * are not materialized at this point */
+    bool mayBeAnnotated = annotationIndex ? annotationIndex->annotatedFunctions.count(&f) : !f.isMaterializable();
+    if (mayBeAnnotated) {
+      MultiValueMap<Value *, ValueInfo> t;
+      readLocalAnnotations(f, t);
+      res.insert(res.end(), t.begin(), t.end());
+    }
 
     /* Otherwise dce pass ignores the function
      * (removed also where it's not required) */
-    f.removeFnAttr(Attribute::OptimizeNone);
+    if (!options.estimateOnly)
+      f.removeFnAttr(Attribute::OptimizeNone);
   }
 }
 
-// Return true on success, false on error
-bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variables,
-				       ConstantExpr *annoPtrInst, Value *instr,
-				       bool *startingPoint)
+/* Widen the ranges in md so that they include the constant c. Every element
+ * of an array or vector is accumulated into the same metadata, every field
+ * of a struct into the corresponding field of the StructInfo. The first
+ * value reaching an InputInfo replaces the range of the annotation, since
+ * the data of a constant global is all the data the variable will ever
+ * hold. */
+static void accumulateConstantRange(Constant *c, MDInfo *md, SmallPtrSetImpl<InputInfo *>& seen)
 {
-  ofstream declarationsFile;
-  declarationsFile.open ("declarations", std::ios_base::app);
-  ValueInfo vi;
+  if (!md || isa<UndefValue>(c))
+    return;
+
+  auto include = [&](APFloat v) {
+    InputInfo *ii = dyn_cast<InputInfo>(md);
+    if (!ii)
+      return;
+    bool losesInfo;
+    v.convert(APFloat::IEEEdouble(), APFloat::rmNearestTiesToEven, &losesInfo);
+    double d = v.convertToDouble();
+    if (!std::isfinite(d))
+      return;
+    if (seen.insert(ii).second) {
+      ii->IRange.reset(new Range(d, d));
+      ii->IFinal = true;
+    } else {
+      ii->IRange->Min = std::min(ii->IRange->Min, d);
+      ii->IRange->Max = std::max(ii->IRange->Max, d);
+    }
+  };
+
+  Type *t = c->getType();
+  if (ConstantFP *cfp = dyn_cast<ConstantFP>(c)) {
+    include(cfp->getValueAPF());
+  } else if (ConstantDataSequential *cds = dyn_cast<ConstantDataSequential>(c)) {
+    if (!cds->getElementType()->isFloatingPointTy())
+      return;
+    for (unsigned i = 0, n = cds->getNumElements(); i < n; i++)
+      include(cds->getElementAsAPFloat(i));
+  } else if (t->isArrayTy() || t->isVectorTy()) {
+    /* zeroinitializer: all the elements are the same */
+    if (isa<ConstantAggregateZero>(c)) {
+      accumulateConstantRange(c->getAggregateElement(0u), md, seen);
+      return;
+    }
+    for (unsigned i = 0, n = c->getNumOperands(); i < n; i++)
+      accumulateConstantRange(cast<Constant>(c->getOperand(i)), md, seen);
+  } else if (t->isStructTy()) {
+    StructInfo *si = dyn_cast<StructInfo>(md);
+    if (!si)
+      return;
+    for (unsigned i = 0, n = si->size(); i < n; i++) {
+      if (Constant *field = c->getAggregateElement(i))
+        accumulateConstantRange(field, si->getField(i).get(), seen);
+    }
+  }
+}
+
 
+/* Annotated constant tables are converted at compile time by the converter.
+ * Their metadata gets the exact range of the constant data, per struct
+ * field where the type has any, marked as final so that later stages do
+ * not widen it. */
+void TaffoInitializer::setConstantInitializerInfo(GlobalVariable *gv, ValueInfo& vi)
+{
+  if (!gv->hasDefinitiveInitializer() || !vi.metadata)
+    return;
+  if (!gv->isConstant() && !(options.tightenRanges && isNeverWritten(gv)))
+    return;
+  SmallPtrSet<InputInfo *, 8> seen;
+  accumulateConstantRange(gv->getInitializer(), vi.metadata.get(), seen);
+  LLVM_DEBUG(dbgs() << "constant initializer of " << gv->getName() << ": " << vi.metadata->toString() << "\n");
+}
+
+
+/* The global holding the string of an annotation */
+static GlobalVariable *getAnnotationString(ConstantExpr *annoPtrInst, StringRef& annstr)
+{
   if (!(annoPtrInst->getOpcode() == Instruction::GetElementPtr))
-    return false;
+    return nullptr;
   GlobalVariable *annoContent = dyn_cast<GlobalVariable>(annoPtrInst->getOperand(0));
   if (!annoContent)
-    return false;
+    return nullptr;
   ConstantDataSequential *annoStr = dyn_cast<ConstantDataSequential>(annoContent->getInitializer());
   if (!annoStr)
-    return false;
+    return nullptr;
   if (!(annoStr->isString()))
-    return false;
+    return nullptr;
+  annstr = annoStr->getAsString();
+  return annoContent;
+}
+
+
+/* Fill the profile table from the profile file and from the define_profile()
+ * annotations of global variables, functions and local variables, which
+ * must come before every other annotation is parsed */
+void TaffoInitializer::readAnnotationProfiles(Module &m)
+{
+  if (!options.annotationProfilesFile.empty()) {
+    std::string err;
+    if (!ctx->annotationProfiles.readFile(options.annotationProfilesFile, err))
+      errs() << "taffo-init: cannot read the annotation profiles: " << err << "\n";
+  }
+
+  auto defineProfile = [&](ConstantExpr *annoPtrInst) {
+    StringRef annstr;
+    GlobalVariable *annoContent = annoPtrInst ? getAnnotationString(annoPtrInst, annstr) : nullptr;
+    if (!annoContent || annstr.find("define_profile") == StringRef::npos)
+      return;
+
+    AnnotationParser parser(&ctx->annotationProfiles);
+    if (!parser.parseAnnotationString(annstr) || !parser.definedProfile.hasValue()) {
+      errs() << "TAFFO annnotation parser syntax error: \n";
+      errs() << "  In profile definition: \"" << annstr << "\"\n";
+      errs() << "  " << parser.lastError() << "\n";
+      return;
+    }
+    ctx->annotationProfiles.insert(parser.definedProfile.getValue(), parser);
+    ctx->parsedAnnotations[annoContent] = ParsedAnnotation();
+  };
+
+  GlobalVariable *globAnnos = m.getGlobalVariable("llvm.global.annotations");
+  ConstantArray *annos = globAnnos ? dyn_cast<ConstantArray>(globAnnos->getInitializer()) : nullptr;
+  if (annos) {
+    for (Value *op: annos->operands()) {
+      ConstantStruct *anno = dyn_cast<ConstantStruct>(op);
+      defineProfile(anno ? dyn_cast<ConstantExpr>(anno->getOperand(1)) : nullptr);
+    }
+  }
 
-  StringRef annstr = annoStr->getAsString();
-  AnnotationParser parser;
-  if (!parser.parseAnnotationString(annstr)) {
-    errs() << "TAFFO annnotation parser syntax error: \n";
-    errs() << "  In annotation: \"" << annstr << "\"\n";
-    errs() << "  " << parser.lastError() << "\n";
+  /* Local variables; the functions which are not materialized have no
+   * local annotations */
+  for (Function &f: m.functions()) {
+    bool mayBeAnnotated = annotationIndex ? annotationIndex->annotatedFunctions.count(&f) : !f.isMaterializable();
+    if (!mayBeAnnotated)
+      continue;
+    for (Instruction &inst: instructions(f)) {
+      CallInst *call = dyn_cast<CallInst>(&inst);
+      if (call && call->getCalledFunction() && call->getCalledFunction()->getName() == "llvm.var.annotation")
+        defineProfile(dyn_cast<ConstantExpr>(call->getOperand(1)));
+    }
+  }
+}
+
+
+// Return true on success, false on error
+bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variables,
+				       ConstantExpr *annoPtrInst, Value *instr,
+				       bool *startingPoint)
+{
+  StringRef annstr;
+  GlobalVariable *annoContent = getAnnotationString(annoPtrInst, annstr);
+  if (!annoContent)
     return false;
+
+  auto cached = ctx->parsedAnnotations.find(annoContent);
+  if (cached == ctx->parsedAnnotations.end()) {
+    AnnotationParser parser(&ctx->annotationProfiles);
+    if (!parser.parseAnnotationString(annstr)) {
+      errs() << "TAFFO annnotation parser syntax error: \n";
+      errs() << "  In annotation: \"" << annstr << "\"\n";
+      errs() << "  " << parser.lastError() << "\n";
+      return false;
+    }
+    if (parser.definedProfile.hasValue())
+      parser.metadata.reset();
+    cached = ctx->parsedAnnotations.insert(std::make_pair(annoContent, ParsedAnnotation(parser))).first;
   }
+  /* Profile definitions are not annotations of the value */
+  if (!cached->second.metadata)
+    return true;
+  ParsedAnnotation ann = cached->second;
+  ann.metadata = copyAnnotationMetadata(ann.metadata.get());
+  if (startingPoint)
+    *startingPoint = ann.startingPoint;
+
+  if (Instruction *toconv = dyn_cast<Instruction>(instr))
+    addAnnotationRoot(variables, toconv->getOperand(0), ann, toconv->getDebugLoc());
+  else
+    addAnnotationRoot(variables, instr, ann, DebugLoc());
+  return true;
+}
+
+
+/* Enqueue the root for an annotation of a local variable (annotated is the
+ * alloca), of a function or of a global variable. loc is the location of
+ * the annotation, if any, used for the declarations. */
+void TaffoInitializer::addAnnotationRoot(MultiValueMap<Value *, ValueInfo>& variables,
+                                         Value *annotated, const ParsedAnnotation& parser, const DebugLoc& loc)
+{
+  ValueInfo vi;
   vi.fixpTypeRootDistance = 0;
   if (!parser.backtracking)
     vi.backtrackingDepthLeft = 0;
   else
-    vi.backtrackingDepthLeft = parser.backtrackingDepth;
+    vi.backtrackingDepthLeft = ValueInfo::clampDepth(parser.backtrackingDepth);
   vi.metadata = parser.metadata;
-  if (startingPoint)
-    *startingPoint = parser.startingPoint;
-  vi.target = parser.target;
+  if (parser.target.hasValue())
+    vi.target = ctx->targetNames.intern(parser.target.getValue());
 
 
 
-  if (Instruction *toconv = dyn_cast<Instruction>(instr)) {
-    variables.push_back(toconv->getOperand(0), vi);
+  if (isa<Instruction>(annotated)) {
+    vi.root = newRoot(annotated);
+    logEnqueue(ProvenanceEdge::LocalAnnotation, nullptr, annotated, vi);
+    variables.push_back(annotated, vi);
 
     if(vi.metadata->isDeclaration()) {
       //printf("DECL #1");
@@ -146,7 +310,7 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
               Range* rng = II->IRange.get();
 
               FixedPointTypeGenError fpgerr;
-              FPType fixedPoint = fixedPointTypeFromRange(*rng, &fpgerr, TotalBits2, FracThreshold2, 64, TotalBits2);
+              FPType fixedPoint = fixedPointTypeFromRange(*rng, &fpgerr, ctx->options.totalBits, ctx->options.fracThreshold, 64, ctx->options.totalBits);
 
               if (fpgerr != FixedPointTypeGenError::InvalidRange) {
                 int width = fixedPoint.getWidth();
@@ -155,13 +319,11 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
                 int integerPart = std::abs(width)-pointPos;
                 unsigned fractionalPart = pointPos;
 
-                const DebugLoc &location = toconv->getDebugLoc();
-
-                if(location) {
-                  declarationsFile << vi.target.getValue() + " " + to_string(location.getLine()) + " " + to_string(integerPart) + " " + to_string(fractionalPart) << endl;
+                if(loc) {
+                  ctx->declarations.push_back({annotated, parser.target.getValue(), (int)loc.getLine(), integerPart, fractionalPart, false});
                 }
                 else {
-                  declarationsFile << vi.target.getValue() + " " + to_string(vi.metadata->getLocation()) + " " + to_string(integerPart) + " " + to_string(fractionalPart) + " function" << endl;
+                  ctx->declarations.push_back({annotated, parser.target.getValue(), vi.metadata->getLocation(), integerPart, fractionalPart, true});
                 }
 
               }
@@ -173,11 +335,15 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
     }
 
     
-  } else if (Function *fun = dyn_cast<Function>(instr)) {
-    enabledFunctions.insert(fun);
+  } else if (Function *fun = dyn_cast<Function>(annotated)) {
+    ctx->enabledFunctions.insert(fun);
+    if (materializer)
+      materializer->materializeReferencing(*fun);
+    vi.root = newRoot(fun);
     for (auto user: fun->users()) {
       if (!(isa<CallInst>(user) || isa<InvokeInst>(user)))
         continue;
+      logEnqueue(ProvenanceEdge::FunctionAnnotation, fun, user, vi);
       variables.push_back(user, vi);
     }
 
@@ -188,6 +354,9 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
     
   } else {
 
+    if (GlobalVariable *gv = dyn_cast<GlobalVariable>(annotated))
+      setConstantInitializerInfo(gv, vi);
+
     // global variables declarations here
     if(vi.metadata->isDeclaration()) {
 
@@ -195,7 +364,7 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
               Range* rng = II->IRange.get();
 
               FixedPointTypeGenError fpgerr;
-              FPType fixedPoint = fixedPointTypeFromRange(*rng, &fpgerr, TotalBits2, FracThreshold2, 64, TotalBits2);
+              FPType fixedPoint = fixedPointTypeFromRange(*rng, &fpgerr, ctx->options.totalBits, ctx->options.fracThreshold, 64, ctx->options.totalBits);
 
               if (fpgerr != FixedPointTypeGenError::InvalidRange) {
                 int width = fixedPoint.getWidth();
@@ -205,7 +374,7 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
                 unsigned fractionalPart = pointPos;
 
                 
-                  declarationsFile << vi.target.getValue() + " " + to_string(vi.metadata->getLocation()) + " " + to_string(integerPart) + " " + to_string(fractionalPart) << endl;
+                  ctx->declarations.push_back({annotated, parser.target.getValue(), vi.metadata->getLocation(), integerPart, fractionalPart, false});
                 
 
               }
@@ -213,12 +382,82 @@ bool TaffoInitializer::parseAnnotation(MultiValueMap<Value *, ValueInfo>& variab
       }
 
     }
-    variables.push_back(instr, vi);
+    vi.root = newRoot(annotated);
+    logEnqueue(ProvenanceEdge::GlobalAnnotation, nullptr, annotated, vi);
+    variables.push_back(annotated, vi);
   }
+}
 
-  declarationsFile.close();
 
-  return true;
+/* Annotations from the precompiled database (-taffo-init-annotation-db).
+ * Every candidate costs one lookup per key; values annotated in the source
+ * keep their source annotation. */
+void TaffoInitializer::readDatabaseAnnotations(Module &m, const AnnotationDatabase& db,
+                                               MultiValueMap<Value *, ValueInfo>& global,
+                                               MultiValueMap<Value *, ValueInfo>& local)
+{
+  ParsedAnnotation ann;
+  unsigned found = 0;
+
+  for (GlobalVariable &gv: m.globals()) {
+    if (gv.getName().startswith("llvm.") || global.count(&gv))
+      continue;
+    if (!db.lookup(("@" + gv.getName()).str(), ann))
+      continue;
+    addAnnotationRoot(global, &gv, ann, DebugLoc());
+    found++;
+  }
+
+  MultiValueMap<Value *, ValueInfo> calls;
+  for (Function &f: m.functions()) {
+    if (f.isIntrinsic())
+      continue;
+    if (!ctx->enabledFunctions.count(&f) && db.lookup(("@" + f.getName()).str(), ann)) {
+      addAnnotationRoot(calls, &f, ann, DebugLoc());
+      found++;
+    }
+
+    std::string localPrefix = (f.getName() + ":").str();
+    std::string linePrefix = (f.getName() + "@").str();
+    if (!db.hasKeyWithPrefix(localPrefix) && !db.hasKeyWithPrefix(linePrefix))
+      continue;
+    if (materializer)
+      materializer->materialize(f);
+    if (f.isDeclaration())
+      continue;
+
+    DenseMap<AllocaInst *, DbgDeclareInst *> declares;
+    for (Instruction &inst: instructions(f)) {
+      if (DbgDeclareInst *dd = dyn_cast<DbgDeclareInst>(&inst)) {
+        if (AllocaInst *alloca = dyn_cast_or_null<AllocaInst>(dd->getAddress()))
+          declares[alloca] = dd;
+      }
+    }
+
+    bool startingPoint = false;
+    for (Instruction &inst: instructions(f)) {
+      AllocaInst *alloca = dyn_cast<AllocaInst>(&inst);
+      if (!alloca || local.count(alloca))
+        continue;
+      DbgDeclareInst *dd = declares.lookup(alloca);
+      StringRef varName = dd ? dd->getVariable()->getName() : alloca->getName();
+
+      bool hit = !varName.empty() && db.lookup(localPrefix + varName.str(), ann);
+      if (!hit && dd)
+        hit = db.lookup(linePrefix + std::to_string(dd->getVariable()->getLine()), ann);
+      if (!hit)
+        continue;
+      addAnnotationRoot(local, alloca, ann, dd ? dd->getDebugLoc() : DebugLoc());
+      startingPoint |= ann.startingPoint;
+      found++;
+    }
+    if (startingPoint && !options.estimateOnly)
+      mdutils::MetadataManager::setStartingPoint(f);
+  }
+  removeNoFloatTy(calls);
+  global.insert(global.end(), calls.begin(), calls.end());
+
+  LLVM_DEBUG(dbgs() << found << " annotations applied from the database\n");
 }
 
 
@@ -243,12 +482,7 @@ void TaffoInitializer::removeNoFloatTy(MultiValueMap<Value *, ValueInfo>& res)
       continue;
     }
 
-    while (ty->isArrayTy() || ty->isPointerTy()) {
-      if (ty->isPointerTy())
-        ty = ty->getPointerElementType();
-      else
-        ty = ty->getArrayElementType();
-    }
+    ty = fullyUnwrapPointerArrayOrVectorType(ty);
     if (!ty->isFloatingPointTy()) {
       LLVM_DEBUG(dbgs() << "annotated instruction " << *it << " does not allocate a"
         " kind of float; ignored\n");
@@ -259,6 +493,12 @@ void TaffoInitializer::removeNoFloatTy(MultiValueMap<Value *, ValueInfo>& res)
 
 void TaffoInitializer::printAnnotatedObj(Module &m)
 {
+  /* The annotations are parsed again in a scratch context, so that the
+   * roots, declarations and enabled functions of the run are not
+   * duplicated */
+  std::unique_ptr<InitializerContext> runCtx = std::move(ctx);
+  ctx.reset(new InitializerContext(m, options));
+  ctx->annotationProfiles = runCtx->annotationProfiles;
   MultiValueMap<Value *, ValueInfo> res;
 
   readGlobalAnnotations(m, res, true);
@@ -301,5 +541,6 @@ void TaffoInitializer::printAnnotatedObj(Module &m)
     errs() << "\n";
   }
 
+  ctx = std::move(runCtx);
 }
 
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <map>
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/FunctionComparator.h"
+#include "TaffoInitializerPass.h"
+#include "Metadata.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+STATISTIC(ClonesMerged, "Number of clones merged into an identical clone of the same function");
+STATISTIC(FunctionsRemoved, "Number of functions removed by the cleanup, merged clones included");
+
+
+/* Cleanup after the specialization.
+ * Every call gets its own clone, so the calls with the same argument
+ * metadata produce clones which are identical: same body, same metadata on
+ * the function and on every instruction. They are merged into the first of
+ * them. Then the local functions which were specialized and the clones which
+ * are no longer called are removed. Both steps are repeated until nothing
+ * changes: merging the clones called by two clones can make them identical,
+ * and removing a function can leave unused the clones it called.
+ * Each clone has its own copy of the debug info of the original, so with
+ * debug info the clones are never identical. */
+
+
+/* The metadata attachments of f, without its debug info and the clone
+ * chain, which are different in every clone */
+static void getComparableMetadata(const Function &f, SmallVectorImpl<std::pair<unsigned, MDNode *>>& res)
+{
+  LLVMContext &c = f.getContext();
+  unsigned clonedKind = c.getMDKindID(CLONED_FUN_METADATA);
+  unsigned sourceKind = c.getMDKindID(SOURCE_FUN_METADATA);
+  f.getAllMetadata(res);
+  res.erase(std::remove_if(res.begin(), res.end(), [&](const std::pair<unsigned, MDNode *>& md) {
+    return md.first == LLVMContext::MD_dbg || md.first == clonedKind || md.first == sourceKind;
+  }), res.end());
+}
+
+
+/* Whether two functions which FunctionComparator found equal also carry
+ * the same metadata; the metadata nodes are uniqued, so equal nodes are the
+ * same node */
+static bool haveSameMetadata(Function &a, Function &b)
+{
+  SmallVector<std::pair<unsigned, MDNode *>, 8> mda, mdb;
+  getComparableMetadata(a, mda);
+  getComparableMetadata(b, mdb);
+  if (mda != mdb)
+    return false;
+
+  for (auto ia = inst_begin(a), ib = inst_begin(b); ia != inst_end(a); ++ia, ++ib) {
+    mda.clear();
+    mdb.clear();
+    ia->getAllMetadataOtherThanDebugLoc(mda);
+    ib->getAllMetadataOtherThanDebugLoc(mdb);
+    if (mda != mdb)
+      return false;
+  }
+  return true;
+}
+
+
+static Function *getSourceFunction(Function *f)
+{
+  MDNode *source = f->getMetadata(SOURCE_FUN_METADATA);
+  if (!source || source->getNumOperands() == 0)
+    return nullptr;
+  return mdconst::dyn_extract_or_null<Function>(source->getOperand(0));
+}
+
+
+static void getClones(Function *f, SmallVectorImpl<Function *>& res)
+{
+  MDNode *cloned = f->getMetadata(CLONED_FUN_METADATA);
+  if (!cloned)
+    return;
+  for (const MDOperand& op: cloned->operands()) {
+    if (Function *clone = mdconst::dyn_extract_or_null<Function>(op))
+      res.push_back(clone);
+  }
+}
+
+
+/* Drop f from the clone chain of its source; the chain must be updated
+ * before the uses of f are replaced, which would replace f in the chain as
+ * well */
+static void unlinkClone(Function *f)
+{
+  Function *oldF = getSourceFunction(f);
+  if (!oldF)
+    return;
+  SmallVector<Function *, 8> clones;
+  getClones(oldF, clones);
+  SmallSetVector<Function *, 8> unique(clones.begin(), clones.end());
+  SmallVector<Metadata *, 8> rest;
+  for (Function *clone: unique) {
+    if (clone != f)
+      rest.push_back(ValueAsMetadata::get(clone));
+  }
+  oldF->setMetadata(CLONED_FUN_METADATA, rest.empty() ? nullptr : MDNode::get(f->getContext(), rest));
+  f->setMetadata(SOURCE_FUN_METADATA, nullptr);
+}
+
+
+/* A removed original leaves nothing for its clones and for the calls to
+ * them to refer to */
+static void unlinkOriginal(Function *f)
+{
+  SmallVector<Function *, 8> clones;
+  getClones(f, clones);
+  for (Function *clone: clones) {
+    if (getSourceFunction(clone) != f)
+      continue;
+    clone->setMetadata(SOURCE_FUN_METADATA, nullptr);
+    for (User *u: clone->users()) {
+      Instruction *call = dyn_cast<Instruction>(u);
+      if (call && call->getMetadata(ORIGINAL_FUN_METADATA))
+        call->setMetadata(ORIGINAL_FUN_METADATA, nullptr);
+    }
+  }
+  f->setMetadata(CLONED_FUN_METADATA, nullptr);
+}
+
+
+/* Whether f is only called by itself */
+static bool isUnused(Function &f)
+{
+  f.removeDeadConstantUsers();
+  for (User *u: f.users()) {
+    Instruction *inst = dyn_cast<Instruction>(u);
+    if (!inst || inst->getFunction() != &f)
+      return false;
+  }
+  return true;
+}
+
+
+/* Merge the identical clones of each function; the merged clones are
+ * added to removed */
+bool TaffoInitializer::mergeIdenticalClones(Module &m, SmallPtrSetImpl<Function *>& removed)
+{
+  bool changed = false;
+  GlobalNumberState globalNumbers;
+
+  for (Function &oldF: m.functions()) {
+    SmallVector<Function *, 8> clones;
+    getClones(&oldF, clones);
+    if (clones.size() < 2)
+      continue;
+
+    std::multimap<FunctionComparator::FunctionHash, Function *> kept;
+    for (Function *clone: clones) {
+      if (removed.count(clone) || clone->isDeclaration())
+        continue;
+      FunctionComparator::FunctionHash hash = FunctionComparator::functionHash(*clone);
+      Function *same = nullptr;
+      /* Only local clones which are not themselves specialized can go */
+      if (clone->hasLocalLinkage() && !clone->getMetadata(CLONED_FUN_METADATA)) {
+        auto range = kept.equal_range(hash);
+        for (auto K = range.first; K != range.second && !same; ++K) {
+          if (FunctionComparator(K->second, clone, &globalNumbers).compare() == 0 &&
+              haveSameMetadata(*K->second, *clone))
+            same = K->second;
+        }
+      }
+      if (!same) {
+        kept.insert(std::make_pair(hash, clone));
+        continue;
+      }
+
+      LLVM_DEBUG(dbgs() << "merging clone " << clone->getName() << " into " << same->getName() << "\n");
+      getRemarkEmitter(same).emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "CloneMerged", DiagnosticLocation(same->getSubprogram()), &same->getEntryBlock())
+            << "merged " << ore::NV("Clone", clone->getName()) << " into identical clone "
+            << ore::NV("Kept", same);
+      });
+      unlinkClone(clone);
+      clone->replaceAllUsesWith(same);
+      removed.insert(clone);
+      ClonesMerged++;
+      ctx->clonesMerged++;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+
+void TaffoInitializer::cleanupClones(Module &m, ConvQueueT& vals)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  for (;;) {
+    SmallPtrSet<Function *, 16> removed;
+    mergeIdenticalClones(m, removed);
+
+    for (Function &f: m.functions()) {
+      if (removed.count(&f) || f.isDeclaration() || !f.hasLocalLinkage())
+        continue;
+      if (!f.getMetadata(CLONED_FUN_METADATA) && !f.getMetadata(SOURCE_FUN_METADATA))
+        continue;
+      if (isUnused(f)) {
+        LLVM_DEBUG(dbgs() << "removing unused function " << f.getName() << "\n");
+        removed.insert(&f);
+      }
+    }
+    if (removed.empty())
+      break;
+
+    /* Nothing in the removed functions may be left in the queue */
+    for (auto V = vals.begin(); V != vals.end();) {
+      Function *parent = nullptr;
+      if (Instruction *inst = dyn_cast<Instruction>(V->first))
+        parent = inst->getFunction();
+      else if (Argument *arg = dyn_cast<Argument>(V->first))
+        parent = arg->getParent();
+      if (parent && removed.count(parent))
+        V = vals.erase(V);
+      else
+        ++V;
+    }
+
+    for (Function *f: removed) {
+      unlinkClone(f);
+      unlinkOriginal(f);
+      ctx->enabledFunctions.erase(f);
+      ctx->remarkEmitters.erase(f);
+      for (Instruction& inst: instructions(f))
+        ctx->attachedMetadata.erase(&inst);
+      f->dropAllReferences();
+    }
+    for (Function *f: removed) {
+      f->eraseFromParent();
+      FunctionsRemoved++;
+      ctx->functionsRemoved++;
+    }
+  }
+
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
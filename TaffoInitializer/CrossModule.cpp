@@ -0,0 +1,275 @@
+#include <algorithm>
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+#include "AnnotationParser.h"
+#include "Metadata.h"
+
+
+using namespace llvm;
+using namespace taffo;
+using namespace mdutils;
+
+
+STATISTIC(CallsImported, "Number of calls redirected to clones defined in other modules");
+STATISTIC(ClonesExported, "Number of clones created for calls from other modules");
+
+
+/* Cross-module specialization, in the style of ThinLTO.
+ * 1. Every module is processed with -taffo-init-summary-out, which writes
+ *      def <function>                    externally visible definitions
+ *      fwd <function> <callee> <i=j,...> argument i of a call to another
+ *                                        module is parameter j, unchanged
+ *      call <callee> <signature>         annotated calls to other modules
+ *    with the fields separated by tabs.
+ * 2. taffo-init-thinlink reads the summaries of all the modules and decides
+ *    the clones, following the forwarded arguments across modules:
+ *      clone <function> <signature> <clone name>
+ * 3. Every module is processed again with -taffo-init-thinlink-decisions:
+ *    the clones of the functions it defines are created and exported under
+ *    their decided name, and its calls with a decided signature are
+ *    redirected to the clone, wherever it is defined.
+ * A signature lists the annotated arguments of a call as <index>=<metadata>
+ * separated by ";", with the metadata written in the annotation grammar. */
+
+
+static void printAnnotation(raw_ostream& os, const MDInfo *md)
+{
+  if (!md) {
+    os << "void";
+    return;
+  }
+  if (const StructInfo *si = dyn_cast<StructInfo>(md)) {
+    os << "struct[";
+    for (unsigned i = 0; i < si->size(); i++) {
+      if (i > 0)
+        os << ", ";
+      printAnnotation(os, si->getField(i).get());
+    }
+    os << "]";
+    return;
+  }
+  const InputInfo *ii = cast<InputInfo>(md);
+  os << "scalar(";
+  if (ii->IRange)
+    os << "range(" << format("%.17g", ii->IRange->Min) << ", " << format("%.17g", ii->IRange->Max) << ") ";
+  if (const FPType *fpt = dyn_cast_or_null<FPType>(ii->IType.get()))
+    os << "type(" << (fpt->isSigned() ? "signed " : "unsigned ") << fpt->getWidth() << " " << fpt->getPointPos() << ") ";
+  if (ii->IError)
+    os << "error(" << format("%.17g", *ii->IError) << ") ";
+  if (!ii->IEnableConversion)
+    os << "disabled ";
+  if (ii->IFinal)
+    os << "final ";
+  os << ")";
+}
+
+
+std::string TaffoInitializer::getCrossModuleSignature(ArrayRef<Value *> actuals, ConvQueueT& vals)
+{
+  std::string res;
+  raw_string_ostream os(res);
+  bool first = true;
+  for (unsigned i = 0; i < actuals.size(); i++) {
+    auto VI = actuals[i] ? vals.find(actuals[i]) : vals.end();
+    if (VI == vals.end() || !VI->second.metadata)
+      continue;
+    if (!first)
+      os << ";";
+    first = false;
+    os << i << "=";
+    printAnnotation(os, VI->second.metadata.get());
+  }
+  return os.str();
+}
+
+
+/* A call with annotated arguments to a function of another module is
+ * recorded for the summary, and redirected to the clone decided by the
+ * thin link if there is one */
+bool TaffoInitializer::specializeAcrossModules(CallSite *call, Function *callee, ArrayRef<Value *> actuals, ConvQueueT& vals)
+{
+  /* The signature is only needed for the summary or the thin link */
+  if (options.summaryFile.empty() && ctx->thinLinkClones.empty())
+    return false;
+  std::string sig = getCrossModuleSignature(actuals, vals);
+  if (sig.empty())
+    return false;
+  std::string key = (callee->getName() + "\t" + sig).str();
+  if (!options.summaryFile.empty())
+    ctx->importRequests.insert(key);
+
+  auto found = ctx->thinLinkClones.find(key);
+  if (found == ctx->thinLinkClones.end())
+    return false;
+  Module *m = callee->getParent();
+  Function *clone = m->getFunction(found->second);
+  if (!clone)
+    clone = Function::Create(callee->getFunctionType(), GlobalValue::ExternalLinkage, found->second, m);
+  else if (clone->getFunctionType() != callee->getFunctionType())
+    return false;
+
+  Instruction *callInst = call->getInstruction();
+  call->setCalledFunction(clone);
+  callInst->setMetadata(ORIGINAL_FUN_METADATA, MDNode::get(m->getContext(), ValueAsMetadata::get(callee)));
+  CallsImported++;
+  getRemarkEmitter(callInst->getFunction()).emit([&]() {
+    return OptimizationRemark(DEBUG_TYPE, "CloneImported", callInst)
+        << "call to " << ore::NV("Callee", callee) << " redirected to "
+        << ore::NV("Clone", found->second) << " in another module";
+  });
+  return true;
+}
+
+
+bool TaffoInitializer::readThinLinkDecisions(Module &m)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(options.thinLinkDecisionsFile);
+  if (!buf) {
+    errs() << "taffo-init: cannot read the thin link decisions: " << buf.getError().message() << "\n";
+    return false;
+  }
+  for (line_iterator line(**buf, true, '#'); !line.is_at_eof(); ++line) {
+    SmallVector<StringRef, 4> fields;
+    line->split(fields, '\t');
+    if (fields.size() != 4 || fields[0] != "clone")
+      continue;
+    ctx->thinLinkClones[(fields[1] + "\t" + fields[2]).str()] = fields[3].str();
+  }
+  return !ctx->thinLinkClones.empty();
+}
+
+
+/* Clones of the functions defined in this module requested by the calls of
+ * other modules. They are created before the calls are specialized, so
+ * that their own calls are specialized as well. */
+void TaffoInitializer::createExportedClones(Module &m, ConvQueueT& vals, ConvQueueT& global)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  for (auto& decision: ctx->thinLinkClones) {
+    StringRef calleeName, sig;
+    std::tie(calleeName, sig) = decision.getKey().split('\t');
+    StringRef cloneName = decision.getValue();
+    Function *oldF = m.getFunction(calleeName);
+    if (!oldF || !oldF->hasExternalLinkage())
+      continue;
+    if (materializer)
+      materializer->materialize(*oldF);
+    if (oldF->isDeclaration() || m.getFunction(cloneName))
+      continue;
+
+    /* The metadata of each annotated argument */
+    SmallVector<ValueInfo, 8> infos(oldF->arg_size());
+    SmallVector<const ValueInfo *, 8> argInfos(oldF->arg_size(), nullptr);
+    SmallVector<StringRef, 8> args;
+    sig.split(args, ';');
+    bool valid = true;
+    for (StringRef arg: args) {
+      StringRef index, annotation;
+      std::tie(index, annotation) = arg.split('=');
+      unsigned i;
+      AnnotationParser parser;
+      if (index.getAsInteger(10, i) || i >= oldF->arg_size() || !parser.parseAnnotationString(annotation)) {
+        valid = false;
+        break;
+      }
+      infos[i].metadata = parser.metadata;
+      infos[i].fixpTypeRootDistance = 0;
+      infos[i].backtrackingDepthLeft = 0;
+      infos[i].root = newRoot(&*std::next(oldF->arg_begin(), i));
+      argInfos[i] = &infos[i];
+    }
+    if (!valid) {
+      errs() << "taffo-init: invalid signature for " << cloneName << " in the thin link decisions\n";
+      continue;
+    }
+
+    std::vector<Value *> newVals;
+    Function *newF = cloneFunctionAndQueue(oldF, None, argInfos, vals, global, newVals);
+    newF->setName(cloneName);
+    newF->setLinkage(GlobalValue::ExternalLinkage);
+    linkClone(oldF, newF);
+    ctx->enabledFunctions.insert(newF);
+    ClonesExported++;
+    LLVM_DEBUG(dbgs() << "exported clone " << newF->getName() << " of " << oldF->getName() << "\n");
+  }
+
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
+
+
+/* Calls to functions of other modules whose arguments are parameters of f,
+ * passed directly or, at -O0, loaded from the alloca they are spilled to */
+static void writeForwardedArguments(raw_ostream& os, Function &f)
+{
+  DenseMap<Value *, unsigned> paramOf;
+  for (Argument &arg: f.args()) {
+    paramOf[&arg] = arg.getArgNo();
+    for (User *u: arg.users()) {
+      StoreInst *store = dyn_cast<StoreInst>(u);
+      if (store && store->getValueOperand() == &arg && isa<AllocaInst>(store->getPointerOperand()))
+        paramOf[store->getPointerOperand()] = arg.getArgNo();
+    }
+  }
+
+  for (Instruction &inst: instructions(f)) {
+    CallSite call(&inst);
+    if (!call)
+      continue;
+    Function *callee = call.getCalledFunction();
+    if (!callee || !callee->isDeclaration() || callee->isIntrinsic())
+      continue;
+    std::string pairs;
+    for (unsigned i = 0; i < call.arg_size(); i++) {
+      Value *arg = call.getArgument(i);
+      if (LoadInst *load = dyn_cast<LoadInst>(arg))
+        arg = load->getPointerOperand();
+      auto found = paramOf.find(arg);
+      if (found == paramOf.end())
+        continue;
+      if (!pairs.empty())
+        pairs += ",";
+      pairs += std::to_string(i) + "=" + std::to_string(found->second);
+    }
+    if (!pairs.empty())
+      os << "fwd\t" << f.getName() << "\t" << callee->getName() << "\t" << pairs << "\n";
+  }
+}
+
+
+void TaffoInitializer::writeModuleSummary(Module &m)
+{
+  std::string fn = TaffoInitializerOptions::fileNameFor(options.summaryFile, m);
+  std::error_code ec;
+  raw_fd_ostream os(fn, ec, sys::fs::F_Text);
+  if (ec) {
+    errs() << "taffo-init: cannot write the module summary: " << ec.message() << "\n";
+    return;
+  }
+
+  os << "module\t" << m.getModuleIdentifier() << "\n";
+  for (Function &f: m.functions()) {
+    if (f.isDeclaration() || !f.hasExternalLinkage() || f.getMetadata(SOURCE_FUN_METADATA))
+      continue;
+    if (materializer)
+      materializer->materialize(f);
+    os << "def\t" << f.getName() << "\n";
+    writeForwardedArguments(os, f);
+  }
+
+  std::vector<StringRef> requests;
+  for (auto& request: ctx->importRequests)
+    requests.push_back(request.getKey());
+  std::sort(requests.begin(), requests.end());
+  for (StringRef request: requests)
+    os << "call\t" << request << "\n";
+}
@@ -0,0 +1,160 @@
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
+#include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+STATISTIC(CallsDevirtualized, "Number of indirect calls promoted to guarded direct calls");
+
+
+/* Speculative devirtualization.
+ * An indirect call with annotated arguments is rewritten into a chain of
+ *   if (callee == @f) call @f(...) else ...
+ * for each function @f it may call, keeping the indirect call as the last
+ * alternative. The direct calls are then specialized like any other call.
+ * Since the indirect call is kept, the set of targets does not need to be
+ * complete: it is taken from the function pointer tables and the stores the
+ * pass can see. */
+
+
+/* Functions referenced by the constant c, looking into aggregates (tables
+ * of function pointers, structures of callbacks, vtables) and casts */
+static void collectFunctionsInConstant(Constant *c, SmallSetVector<Function *, 4>& res, unsigned depth = 0)
+{
+  if (depth > 8)
+    return;
+  c = c->stripPointerCasts();
+  if (Function *f = dyn_cast<Function>(c)) {
+    res.insert(f);
+  } else if (isa<ConstantAggregate>(c)) {
+    for (Value *op: c->operands())
+      collectFunctionsInConstant(cast<Constant>(op), res, depth + 1);
+  }
+}
+
+
+void TaffoInitializer::collectPossibleCallees(Value *callee, SmallSetVector<Function *, 4>& res, unsigned depth)
+{
+  if (depth > 8)
+    return;
+  callee = callee->stripPointerCasts();
+
+  if (Function *f = dyn_cast<Function>(callee)) {
+    res.insert(f);
+  } else if (SelectInst *sel = dyn_cast<SelectInst>(callee)) {
+    collectPossibleCallees(sel->getTrueValue(), res, depth + 1);
+    collectPossibleCallees(sel->getFalseValue(), res, depth + 1);
+  } else if (PHINode *phi = dyn_cast<PHINode>(callee)) {
+    for (Value *in: phi->incoming_values())
+      collectPossibleCallees(in, res, depth + 1);
+  } else if (LoadInst *load = dyn_cast<LoadInst>(callee)) {
+    Value *ptr = load->getPointerOperand()->stripPointerCasts();
+
+    /* Load from a constant table at a constant index */
+    if (Constant *cptr = dyn_cast<Constant>(ptr)) {
+      const DataLayout &dl = load->getModule()->getDataLayout();
+      if (Constant *folded = ConstantFoldLoadFromConstPtr(cptr, load->getType(), dl)) {
+        collectFunctionsInConstant(folded, res);
+        return;
+      }
+    }
+
+    /* Any entry of the table, or any function stored in the slot */
+    Value *base = ptr;
+    if (GEPOperator *gep = dyn_cast<GEPOperator>(ptr))
+      base = gep->getPointerOperand()->stripPointerCasts();
+    if (GlobalVariable *gv = dyn_cast<GlobalVariable>(base)) {
+      if (gv->hasDefinitiveInitializer())
+        collectFunctionsInConstant(gv->getInitializer(), res);
+      if (gv->isConstant())
+        return;
+      if (materializer)
+        materializer->materializeReferencing(*gv);
+    } else if (!isa<AllocaInst>(base)) {
+      return;
+    }
+    for (User *u: base->users()) {
+      if (StoreInst *store = dyn_cast<StoreInst>(u))
+        collectPossibleCallees(store->getValueOperand(), res, depth + 1);
+    }
+  }
+}
+
+
+bool TaffoInitializer::devirtualizeCall(CallSite *call, ConvQueueT& vals)
+{
+  if (options.devirtualizationTargets == 0)
+    return false;
+  Instruction *callInst = call->getInstruction();
+
+  bool annotatedArg = false;
+  for (unsigned i = 0; i < call->getNumArgOperands() && !annotatedArg; i++)
+    annotatedArg = vals.count(call->getArgument(i));
+  if (!annotatedArg)
+    return false;
+
+  SmallSetVector<Function *, 4> candidates;
+  collectPossibleCallees(call->getCalledValue(), candidates);
+  SmallVector<Function *, 4> targets;
+  for (Function *f: candidates) {
+    if (materializer)
+      materializer->materialize(*f);
+    if (!isCloningCandidate(f))
+      continue;
+    const char *reason = nullptr;
+    if (!isLegalToPromote(CallSite(callInst), f, &reason)) {
+      LLVM_DEBUG(dbgs() << "cannot promote " << *callInst << " to " << f->getName() << ": " << reason << "\n");
+      continue;
+    }
+    targets.push_back(f);
+  }
+  if (targets.empty() || targets.size() > options.devirtualizationTargets) {
+    LLVM_DEBUG(dbgs() << "not devirtualizing " << *callInst << ", " << targets.size() << " possible targets\n");
+    return false;
+  }
+
+  ValueInfo callVi = vals[callInst];
+  for (Function *f: targets) {
+    Instruction *direct = promoteCallWithIfThenElse(CallSite(callInst), f);
+    LLVM_DEBUG(dbgs() << "promoted " << *callInst << " to " << *direct << "\n");
+    ValueInfo& directVi = vals.push_back(direct, callVi).first->second;
+    logEnqueue(ProvenanceEdge::User, callInst, direct, directVi);
+    setMetadataOfValue(direct, directVi);
+
+    /* The results of the alternatives are merged by a phi which replaces
+     * the result of the indirect call */
+    for (User *u: direct->users()) {
+      PHINode *phi = dyn_cast<PHINode>(u);
+      if (!phi || vals.count(phi))
+        continue;
+      ValueInfo& phiVi = vals.push_back(phi, callVi).first->second;
+      logEnqueue(ProvenanceEdge::User, direct, phi, phiVi);
+      setMetadataOfValue(phi, phiVi);
+    }
+  }
+
+  CallsDevirtualized++;
+  ctx->callsDevirtualized++;
+  ctx->cfgChanged = true;
+  getRemarkEmitter(callInst->getFunction()).emit([&]() {
+    OptimizationRemark r(DEBUG_TYPE, "Devirtualized", callInst);
+    r << "indirect call promoted to guarded calls to ";
+    for (unsigned i = 0; i < targets.size(); i++) {
+      if (i > 0)
+        r << ", ";
+      r << ore::NV("Callee", targets[i]);
+    }
+    return r;
+  });
+  return true;
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+/* Estimation mode (-taffo-init-estimate).
+ * The propagation runs as usual, but the calls which would be specialized
+ * are followed into the original callees instead of into clones, and no
+ * metadata is attached. The cost of a callee is computed once per argument
+ * signature, since the pass would reuse the same analysis for every clone
+ * with that signature. */
+
+
+void TaffoInitializer::estimateConversion(Module &m, ConvQueueT& roots, ConvQueueT& global)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  ConversionEstimate est;
+  ConvQueueT vals;
+  buildConversionQueueForRootValues(roots, vals);
+  est.rootQueueSize = vals.size();
+  for (auto VVI = vals.begin(); VVI != vals.end(); ++VVI)
+    est.rootValues[VVI->second.root]++;
+
+  for (auto VVI = vals.begin(); VVI != vals.end(); ++VVI) {
+    Value *v = VVI->first;
+    if (!(isa<CallInst>(v) || isa<InvokeInst>(v)))
+      continue;
+    CallSite call(v);
+    CloneCost cost = estimateCloneCost(&call, vals, global, est);
+    est.cloning.queueSize += cost.queueSize;
+    est.cloning.clones += cost.clones;
+    est.cloning.instructions += cost.instructions;
+  }
+  ctx->conversionQueueSize = est.rootQueueSize + est.cloning.queueSize;
+  ctx->functionCloned = est.cloning.clones;
+
+  std::string filename = TaffoInitializerOptions::fileNameFor(options.estimateFile, m);
+  if (filename.empty() || filename == "-") {
+    printEstimate(errs(), m, est);
+  } else {
+    std::error_code ec;
+    raw_fd_ostream os(filename, ec, sys::fs::F_Text);
+    if (ec)
+      errs() << "taffo-init: cannot open " << filename << ": " << ec.message() << "\n";
+    else
+      printEstimate(os, m, est);
+  }
+
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
+
+
+/* Mirrors createFunctionAndQueue on the original callee. Recursive calls
+ * whose signature is already being estimated are not counted again, as the
+ * clone would call itself. */
+CloneCost TaffoInitializer::estimateCloneCost(CallSite *call, ConvQueueT& vals, ConvQueueT& global, ConversionEstimate& est)
+{
+  CloneCost res;
+  Function *f = call->getCalledFunction();
+  SmallVector<Value *, 8> actuals;
+  int callbackOperand = getCallbackArguments(call, actuals);
+  if (callbackOperand >= 0)
+    f = cast<Function>(call->getArgument(callbackOperand)->stripPointerCasts());
+  else
+    actuals.assign(call->arg_begin(), call->arg_end());
+  if (f && materializer)
+    materializer->materialize(*f);
+  if (!isCloningCandidate(f))
+    return res;
+
+  std::string signature = (f->getName() + "(" + getArgumentSignature(actuals, vals) + ")").str();
+  auto known = est.signatures.find(signature);
+  if (known != est.signatures.end())
+    return known->second;
+  if (!est.inProgress.insert(signature).second)
+    return res;
+
+  ConvQueueT roots;
+  Function::arg_iterator argI = f->arg_begin();
+  for (unsigned i = 0; argI != f->arg_end(); argI++, i++) {
+    Value *callOperand = actuals[i];
+    if (!callOperand)
+      continue;
+    auto callVi = vals.find(callOperand);
+    if (callVi == vals.end())
+      continue;
+
+    ValueInfo argumentVi = callVi->second;
+    argumentVi.fixpTypeRootDistance = ValueInfo::nextRootDistance(callVi->second.fixpTypeRootDistance);
+    Value *allocaOfArgument = nullptr;
+    if (!argI->user_empty() && argI->user_begin()->getNumOperands() > 1)
+      allocaOfArgument = dyn_cast<AllocaInst>(argI->user_begin()->getOperand(1));
+    if (allocaOfArgument) {
+      argumentVi.fixpTypeRootDistance = ValueInfo::nextRootDistance(callVi->second.fixpTypeRootDistance, 2);
+      roots.push_back(allocaOfArgument, argumentVi);
+    } else {
+      roots.push_back(&*argI, argumentVi);
+    }
+  }
+
+  roots.insert(roots.begin(), global.begin(), global.end());
+  ConvQueueT localFix;
+  readLocalAnnotations(*f, localFix);
+  roots.insert(roots.begin(), localFix.begin(), localFix.end());
+  ConvQueueT tmpVals;
+  buildConversionQueueForRootValues(roots, tmpVals);
+
+  ConvQueueT calleeVals;
+  for (auto val = tmpVals.begin(); val != tmpVals.end(); ++val) {
+    /* Arguments are only needed for the signatures of the nested calls */
+    if (Argument *arg = dyn_cast<Argument>(val->first)) {
+      if (arg->getParent() == f)
+        calleeVals.push_back(val->first, val->second);
+      continue;
+    }
+    Instruction *inst = dyn_cast<Instruction>(val->first);
+    if (!inst || inst->getFunction() != f)
+      continue;
+    calleeVals.push_back(val->first, val->second);
+    est.rootValues[val->second.root]++;
+    res.queueSize++;
+  }
+  res.clones = 1;
+  res.instructions = f->getInstructionCount();
+
+  for (auto val = calleeVals.begin(); val != calleeVals.end(); ++val) {
+    Value *v = val->first;
+    if (!(isa<CallInst>(v) || isa<InvokeInst>(v)))
+      continue;
+    CallSite nested(v);
+    CloneCost cost = estimateCloneCost(&nested, calleeVals, global, est);
+    res.queueSize += cost.queueSize;
+    res.clones += cost.clones;
+    res.instructions += cost.instructions;
+  }
+
+  est.inProgress.erase(signature);
+  est.signatures[signature] = res;
+  LLVM_DEBUG(dbgs() << "estimated clone " << signature << ": " << res.queueSize << " values, "
+                    << res.clones << " clones, " << res.instructions << " instructions\n");
+  return res;
+}
+
+
+void TaffoInitializer::printEstimate(raw_ostream& os, Module &m, ConversionEstimate& est)
+{
+  size_t moduleSize = m.getInstructionCount();
+  os << "taffo-init estimate for " << m.getModuleIdentifier() << "\n";
+  os << "  annotations:          " << ctx->annotationCount << "\n";
+  os << "  predicted queue size: " << est.rootQueueSize + est.cloning.queueSize
+     << " (" << est.rootQueueSize << " before cloning)\n";
+  os << "  cloned call sites:    " << est.cloning.clones << "\n";
+  os << "  distinct clones:      " << est.signatures.size() << "\n";
+  os << "  code growth:          " << est.cloning.instructions << " instructions";
+  if (moduleSize)
+    os << format(" (%.1f%% of %u)", 100.0 * est.cloning.instructions / moduleSize, (unsigned)moduleSize);
+  os << "\n";
+  if (ctx->moduleBacktrackingBudgetExhausted || !ctx->cutOffRoots.empty())
+    os << "  backtracking cut off: " << ctx->cutOffRoots.size() << " roots\n";
+
+  /* The cost of a root is dominated by the values it reaches and by the
+   * operands visited while backtracking from them */
+  std::vector<std::pair<uint64_t, ValueInfo::RootID>> costs;
+  for (ValueInfo::RootID r = 1; r <= ctx->rootCount; r++) {
+    uint64_t cost = est.rootValues.lookup(r) + ctx->rootBacktrackingVisits.lookup(r);
+    if (cost)
+      costs.push_back(std::make_pair(cost, r));
+  }
+  std::sort(costs.begin(), costs.end(), [](const std::pair<uint64_t, ValueInfo::RootID>& a,
+                                           const std::pair<uint64_t, ValueInfo::RootID>& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  });
+  if (costs.size() > 10)
+    costs.resize(10);
+
+  os << "  slowest roots (values, backtracked operands):\n";
+  for (auto& c: costs) {
+    Value *root = ctx->rootValues[c.second - 1];
+    os << "    " << est.rootValues.lookup(c.second) << " "
+       << ctx->rootBacktrackingVisits.lookup(c.second) << " ";
+    if (Instruction *i = dyn_cast<Instruction>(root))
+      os << i->getFunction()->getName() << ": " << *i;
+    else if (root->hasName())
+      os << root->getName();
+    else
+      os << *root;
+    os << "\n";
+  }
+}
@@ -0,0 +1,95 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/ModuleSummaryIndex.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+LazyFunctionMaterializer::LazyFunctionMaterializer(Module &m, const ModuleSummaryIndex *index)
+  : module(m)
+{
+  for (Function &f: m.functions()) {
+    if (!f.isMaterializable())
+      continue;
+
+    bool summarized = false;
+    if (index) {
+      if (llvm::ValueInfo fvi = index->getValueInfo(f.getGUID())) {
+        for (const std::unique_ptr<GlobalValueSummary>& gvs: fvi.getSummaryList()) {
+          FunctionSummary *fs = dyn_cast<FunctionSummary>(gvs->getBaseObject());
+          if (!fs)
+            continue;
+          summarized = true;
+          for (const llvm::ValueInfo& ref: fs->refs())
+            referencedBy[ref.getGUID()].push_back(&f);
+          for (const FunctionSummary::EdgeTy& call: fs->calls())
+            referencedBy[call.first.getGUID()].push_back(&f);
+        }
+      }
+    }
+
+    if (!summarized) {
+      LLVM_DEBUG(dbgs() << "function " << f.getName() << " not in the module summary, materializing it\n");
+      materialize(f);
+    }
+  }
+}
+
+
+bool LazyFunctionMaterializer::materializeAnnotated()
+{
+  /* Local annotations reference their annotation string, which is
+   * placed in the llvm.metadata section */
+  if (module.getFunction("llvm.var.annotation")) {
+    for (GlobalVariable &gv: module.globals()) {
+      if (gv.hasSection() && gv.getSection() == "llvm.metadata")
+        materializeReferencing(gv);
+    }
+  }
+  return !failed;
+}
+
+
+bool LazyFunctionMaterializer::materializeReferencing(const GlobalValue &gv)
+{
+  auto refs = referencedBy.find(gv.getGUID());
+  if (refs == referencedBy.end())
+    return !failed;
+  SmallVector<Function *, 4> funcs = std::move(refs->second);
+  referencedBy.erase(refs);
+  for (Function *f: funcs)
+    materialize(*f);
+  return !failed;
+}
+
+
+bool LazyFunctionMaterializer::materialize(Function &f)
+{
+  if (!f.isMaterializable())
+    return !failed;
+  LLVM_DEBUG(dbgs() << "materializing " << f.getName() << "\n");
+  if (Error err = f.materialize()) {
+    logAllUnhandledErrors(std::move(err), errs(), "taffo-init: cannot materialize " + f.getName() + ": ");
+    failed = true;
+    return false;
+  }
+  materializedCount++;
+  return true;
+}
+
+
+bool LazyFunctionMaterializer::materializeAll()
+{
+  for (Function &f: module.functions())
+    materialize(f);
+  referencedBy.clear();
+  return !failed;
+}
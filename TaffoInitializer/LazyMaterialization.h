@@ -0,0 +1,50 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/GlobalValue.h"
+#include "llvm/IR/Module.h"
+
+
+#ifndef __TAFFO_LAZY_MATERIALIZATION_H__
+#define __TAFFO_LAZY_MATERIALIZATION_H__
+
+
+namespace llvm {
+class ModuleSummaryIndex;
+}
+
+
+namespace taffo {
+
+
+/* Materializes the function bodies of a lazily loaded module only when the
+ * initializer may look at them.
+ * Use lists contain only the users in materialized functions, so before the
+ * users of a global value are visited all the functions referencing or
+ * calling it must be materialized. These are found through the reference and
+ * call edges of the module summary; when the module has no summary, or a
+ * function is missing from it, the bodies are materialized eagerly. */
+class LazyFunctionMaterializer {
+public:
+  LazyFunctionMaterializer(llvm::Module &m, const llvm::ModuleSummaryIndex *index);
+
+  /* Materialize the functions containing local annotations */
+  bool materializeAnnotated();
+  /* Materialize the functions which reference or call gv */
+  bool materializeReferencing(const llvm::GlobalValue &gv);
+  bool materialize(llvm::Function &f);
+  bool materializeAll();
+
+  unsigned getMaterializedCount() const { return materializedCount; };
+
+private:
+  llvm::Module &module;
+  llvm::DenseMap<llvm::GlobalValue::GUID, llvm::SmallVector<llvm::Function *, 4>> referencedBy;
+  unsigned materializedCount = 0;
+  bool failed = false;
+};
+
+
+}
+
+
+#endif // __TAFFO_LAZY_MATERIALIZATION_H__
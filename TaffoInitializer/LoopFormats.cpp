@@ -0,0 +1,201 @@
+#include <algorithm>
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+
+
+using namespace llvm;
+using namespace taffo;
+using namespace mdutils;
+
+
+STATISTIC(LoopFormatGroups, "Number of loop nests whose values were given a common format");
+
+
+/* Loop format unification (-taffo-init-unify-loop-formats).
+ * Values whose formats are chosen independently end up with different
+ * widths and point positions even when they are combined in the same loop
+ * body, which then needs shifts and width changes in every iteration and
+ * cannot be vectorized. The instructions of each loop nest (one per
+ * outermost loop) connected through their operands are grouped, together
+ * with the queued operands they use from outside the nest (the allocas,
+ * globals and arguments they load from and store to). Each group gets the
+ * format of the union of the ranges of its members, as long as no member
+ * loses more than a given number of fractional bits with respect to the
+ * format of its own range.
+ * The values outside the nests only join groups, they never connect them:
+ * at -O0 every load of a function comes from an alloca of its entry block,
+ * and the same global can be used by loops in different functions. Such a
+ * value gets the common format only when all the groups it belongs to
+ * agree on it. */
+
+
+static InputInfo *getRangedInputInfo(ValueInfo& vi)
+{
+  InputInfo *ii = dyn_cast_or_null<InputInfo>(vi.metadata.get());
+  if (!ii || !ii->IRange || ii->IType)
+    return nullptr;
+  return ii;
+}
+
+
+namespace {
+
+struct LoopFormatGroup {
+  /* Instructions of the nest */
+  SmallVector<Value *, 8> inside;
+  /* Values defined outside the nest used by them */
+  SmallSetVector<Value *, 8> outside;
+  std::shared_ptr<FPType> common;
+};
+
+}
+
+
+void TaffoInitializer::unifyLoopFormats(ConvQueueT& vals)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  DenseMap<Function *, SmallVector<Instruction *, 32>> queuedInstructions;
+  for (auto VVI = vals.begin(); VVI != vals.end(); ++VVI) {
+    Instruction *inst = dyn_cast<Instruction>(VVI->first);
+    if (inst && getRangedInputInfo(VVI->second) && getTypeSummary(inst->getType()).isFloat)
+      queuedInstructions[inst->getFunction()].push_back(inst);
+  }
+
+  std::vector<LoopFormatGroup> groups;
+  for (auto& fi: queuedInstructions) {
+    DominatorTree dt(*fi.first);
+    LoopInfo li(dt);
+    if (li.empty())
+      continue;
+
+    /* Keyed by the outermost loop of the nest */
+    MapVector<Loop *, EquivalenceClasses<Value *>> nests;
+    MapVector<Loop *, SmallVector<std::pair<Instruction *, Value *>, 16>> outsideUses;
+    for (Instruction *inst: fi.second) {
+      Loop *outer = li.getLoopFor(inst->getParent());
+      if (!outer)
+        continue;
+      while (Loop *parent = outer->getParentLoop())
+        outer = parent;
+
+      EquivalenceClasses<Value *>& classes = nests[outer];
+      classes.insert(inst);
+      for (Value *op: inst->operands()) {
+        auto OVI = vals.find(op);
+        if (OVI == vals.end() || !getRangedInputInfo(OVI->second) || !getTypeSummary(op->getType()).isFloat)
+          continue;
+        Instruction *opInst = dyn_cast<Instruction>(op);
+        if (opInst && outer->contains(opInst->getParent()))
+          classes.unionSets(inst, op);
+        else
+          outsideUses[outer].push_back(std::make_pair(inst, op));
+      }
+    }
+
+    for (auto& nest: nests) {
+      EquivalenceClasses<Value *>& classes = nest.second;
+      DenseMap<Value *, unsigned> groupOf;
+      for (auto GI = classes.begin(); GI != classes.end(); ++GI) {
+        if (!GI->isLeader())
+          continue;
+        groupOf[GI->getData()] = groups.size();
+        groups.emplace_back();
+        for (auto MI = classes.member_begin(GI); MI != classes.member_end(); ++MI)
+          groups.back().inside.push_back(*MI);
+      }
+      for (auto& use: outsideUses[nest.first])
+        groups[groupOf[classes.getLeaderValue(use.first)]].outside.insert(use.second);
+    }
+  }
+
+  const int totalBits = ctx->options.totalBits;
+  const int fracThreshold = ctx->options.fracThreshold;
+  /* The common format of each group, and that of each value outside the
+   * nests, or null when its groups disagree */
+  DenseMap<Value *, std::shared_ptr<FPType>> outsideFormats;
+  for (LoopFormatGroup& group: groups) {
+    SmallVector<Value *, 16> members(group.inside.begin(), group.inside.end());
+    members.append(group.outside.begin(), group.outside.end());
+    if (members.size() < 2)
+      continue;
+
+    Range merged;
+    for (unsigned i = 0; i < members.size(); i++) {
+      const Range& r = *getRangedInputInfo(vals[members[i]])->IRange;
+      merged.Min = i ? std::min(merged.Min, r.Min) : r.Min;
+      merged.Max = i ? std::max(merged.Max, r.Max) : r.Max;
+    }
+
+    FixedPointTypeGenError err;
+    FPType common = fixedPointTypeFromRange(merged, &err, totalBits, fracThreshold, 64, totalBits);
+    if (err != FixedPointTypeGenError::NoError) {
+      LLVM_DEBUG(dbgs() << "no common format for a group of " << members.size() << " values\n");
+      continue;
+    }
+
+    bool fits = true;
+    for (auto MI = members.begin(); MI != members.end() && fits; ++MI) {
+      FixedPointTypeGenError ownErr;
+      FPType own = fixedPointTypeFromRange(*getRangedInputInfo(vals[*MI])->IRange, &ownErr,
+          totalBits, fracThreshold, 64, totalBits);
+      if (ownErr == FixedPointTypeGenError::InvalidRange)
+        continue;
+      fits = (int)own.getPointPos() - (int)common.getPointPos() <= (int)ctx->options.loopFormatMaxFracLoss;
+    }
+    if (!fits) {
+      LLVM_DEBUG(dbgs() << "common format " << common.toString() << " loses too much precision\n");
+      continue;
+    }
+
+    group.common.reset(cast<FPType>(common.clone()));
+    for (Value *v: group.outside) {
+      auto ins = outsideFormats.insert(std::make_pair(v, group.common));
+      std::shared_ptr<FPType>& other = ins.first->second;
+      if (!ins.second && other &&
+          (other->getWidth() != common.getWidth() || other->getPointPos() != common.getPointPos()))
+        other.reset();
+    }
+  }
+
+  DenseMap<Value *, FPType *> formats;
+  auto setFormat = [&](Value *v, FPType *format) {
+    ValueInfo& vi = vals[v];
+    /* The metadata may be shared with the value it was copied from */
+    InputInfo *nii = cast<InputInfo>(vi.metadata->clone());
+    nii->IType.reset(format->clone());
+    vi.metadata.reset(nii);
+    formats[v] = format;
+    LLVM_DEBUG(dbgs() << "  format " << format->toString() << " for " << *v << "\n");
+  };
+  for (LoopFormatGroup& group: groups) {
+    if (!group.common)
+      continue;
+    for (Value *v: group.inside)
+      setFormat(v, group.common.get());
+    LoopFormatGroups++;
+  }
+  /* A value computed in a nest and used by another keeps the format of its
+   * own nest */
+  for (auto& outside: outsideFormats) {
+    if (outside.second && !formats.count(outside.first))
+      setFormat(outside.first, outside.second.get());
+  }
+
+  for (DeclarationRecord& decl: ctx->declarations) {
+    auto found = formats.find(decl.value);
+    if (found == formats.end())
+      continue;
+    decl.integerPart = std::abs((int)found->second->getWidth()) - found->second->getPointPos();
+    decl.fractionalPart = found->second->getPointPos();
+  }
+
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
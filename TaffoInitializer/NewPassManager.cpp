@@ -0,0 +1,91 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "TaffoInitializerPass.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+AnalysisKey TaffoAnnotationAnalysis::Key;
+
+
+AnnotationIndex AnnotationIndex::build(Module &m)
+{
+  AnnotationIndex res;
+
+  if (GlobalVariable *globAnnos = m.getGlobalVariable("llvm.global.annotations")) {
+    if (ConstantArray *annos = dyn_cast<ConstantArray>(globAnnos->getInitializer())) {
+      for (Value *op: annos->operands()) {
+        ConstantStruct *anno = dyn_cast<ConstantStruct>(op);
+        if (!anno)
+          continue;
+        if (GlobalValue *gv = dyn_cast<GlobalValue>(anno->getOperand(0)->stripPointerCasts()))
+          res.annotatedGlobals.push_back(gv);
+      }
+    }
+  }
+
+  /* The calls to the annotation intrinsic are found through its uses,
+   * without looking at the other instructions */
+  for (Function &f: m.functions()) {
+    if (!f.isDeclaration() || !f.getName().startswith("llvm.var.annotation"))
+      continue;
+    for (User *u: f.users()) {
+      if (CallInst *call = dyn_cast<CallInst>(u))
+        res.annotatedFunctions.insert(call->getFunction());
+    }
+  }
+  return res;
+}
+
+
+AnnotationIndex TaffoAnnotationAnalysis::run(Module &m, ModuleAnalysisManager &am)
+{
+  return AnnotationIndex::build(m);
+}
+
+
+PreservedAnalyses TaffoInitializerPass::run(Module &m, ModuleAnalysisManager &am)
+{
+  TaffoInitializer impl(options);
+  impl.annotationIndex = &am.getResult<TaffoAnnotationAnalysis>(m);
+  if (!impl.runOnModule(m))
+    return PreservedAnalyses::all();
+
+  /* Only instructions and metadata were changed in the existing functions;
+   * the function analysis proxy must be preserved for the preserved function
+   * analyses to survive, but not when functions were removed, so that their
+   * cached analyses are dropped */
+  PreservedAnalyses pa;
+  if (!impl.ctx->cfgChanged) {
+    pa.preserveSet<CFGAnalyses>();
+    if (!impl.ctx->functionsRemoved)
+      pa.preserve<FunctionAnalysisManagerModuleProxy>();
+  }
+  return pa;
+}
+
+
+void taffo::registerTaffoInitializerPasses(PassBuilder &pb)
+{
+  pb.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &am) {
+    am.registerPass([]() { return TaffoAnnotationAnalysis(); });
+  });
+  pb.registerPipelineParsingCallback(
+    [](StringRef name, ModulePassManager &mpm, ArrayRef<PassBuilder::PipelineElement>) {
+      if (name != "taffoinit")
+        return false;
+      mpm.addPass(TaffoInitializerPass());
+      return true;
+    });
+}
+
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+  return {LLVM_PLUGIN_API_VERSION, "TaffoInitializer", "v0.1", registerTaffoInitializerPasses};
+}
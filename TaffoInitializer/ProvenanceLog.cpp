@@ -0,0 +1,234 @@
+#include "llvm/IR/Argument.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalValue.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "ProvenanceLog.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+static const char ProvenanceMagic[4] = {'T', 'P', 'R', 'V'};
+
+
+const char *taffo::getProvenanceEdgeName(ProvenanceEdge kind)
+{
+  switch (kind) {
+    case ProvenanceEdge::LocalAnnotation:
+      return "local-annotation";
+    case ProvenanceEdge::GlobalAnnotation:
+      return "global-annotation";
+    case ProvenanceEdge::FunctionAnnotation:
+      return "function-annotation";
+    case ProvenanceEdge::User:
+      return "user";
+    case ProvenanceEdge::Backtracking:
+      return "backtracking";
+    case ProvenanceEdge::Allocation:
+      return "allocation";
+    case ProvenanceEdge::ClonedArgument:
+      return "cloned-argument";
+    case ProvenanceEdge::ClonedAlloca:
+      return "cloned-alloca";
+    case ProvenanceEdge::MemTransfer:
+      return "memtransfer";
+    default:
+      return "unknown";
+  }
+}
+
+
+std::unique_ptr<ProvenanceLog> ProvenanceLog::create(StringRef filename, std::string& err)
+{
+  std::error_code ec;
+  std::unique_ptr<raw_fd_ostream> os(new raw_fd_ostream(filename, ec, sys::fs::F_None));
+  if (ec) {
+    err = ec.message();
+    return nullptr;
+  }
+  os->write(ProvenanceMagic, sizeof(ProvenanceMagic));
+  return std::unique_ptr<ProvenanceLog>(new ProvenanceLog(std::move(os)));
+}
+
+
+ProvenanceLog::ProvenanceLog(std::unique_ptr<raw_fd_ostream> os)
+  : os(std::move(os))
+{ }
+
+
+uint32_t ProvenanceLog::getStringID(StringRef s)
+{
+  auto ins = stringIDs.insert(std::make_pair(s, 0));
+  if (!ins.second)
+    return ins.first->second;
+  uint32_t id = stringIDs.size();
+  ins.first->second = id;
+
+  support::endian::Writer w(*os, support::little);
+  w.write<uint8_t>('S');
+  w.write<uint32_t>(id);
+  w.write<uint32_t>(s.size());
+  os->write(s.data(), s.size());
+  return id;
+}
+
+
+uint32_t ProvenanceLog::getValueID(Value *v)
+{
+  if (!v)
+    return 0;
+  auto found = valueIDs.find(v);
+  if (found != valueIDs.end())
+    return found->second;
+
+  uint32_t func = 0;
+  std::string desc;
+  raw_string_ostream descs(desc);
+  if (Instruction *i = dyn_cast<Instruction>(v)) {
+    func = getStringID(i->getFunction()->getName());
+    descs << i->getOpcodeName();
+  } else if (Argument *a = dyn_cast<Argument>(v)) {
+    func = getStringID(a->getParent()->getName());
+    descs << "arg";
+  } else if (isa<GlobalValue>(v)) {
+    descs << "global";
+  } else {
+    descs << "value";
+  }
+  if (v->hasName())
+    descs << " " << v->getName();
+  uint32_t descID = getStringID(descs.str());
+
+  uint32_t id = valueIDs.size() + 1;
+  valueIDs[v] = id;
+  support::endian::Writer w(*os, support::little);
+  w.write<uint8_t>('V');
+  w.write<uint32_t>(id);
+  w.write<uint32_t>(func);
+  w.write<uint32_t>(descID);
+  return id;
+}
+
+
+void ProvenanceLog::logRoot(uint32_t root, Value *v)
+{
+  uint32_t vid = getValueID(v);
+  support::endian::Writer w(*os, support::little);
+  w.write<uint8_t>('R');
+  w.write<uint32_t>(root);
+  w.write<uint32_t>(vid);
+}
+
+
+void ProvenanceLog::logEdge(ProvenanceEdge kind, Value *src, Value *dst, uint32_t root, uint16_t distance)
+{
+  uint32_t srcID = getValueID(src);
+  uint32_t dstID = getValueID(dst);
+  support::endian::Writer w(*os, support::little);
+  w.write<uint8_t>('E');
+  w.write<uint8_t>(static_cast<uint8_t>(kind));
+  w.write<uint32_t>(srcID);
+  w.write<uint32_t>(dstID);
+  w.write<uint32_t>(root);
+  w.write<uint16_t>(distance);
+}
+
+
+bool ProvenanceLogContents::read(StringRef filename, std::string& err)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(filename);
+  if (!buf) {
+    err = buf.getError().message();
+    return false;
+  }
+  const char *p = (*buf)->getBufferStart();
+  const char *end = (*buf)->getBufferEnd();
+  if (end - p < 4 || StringRef(p, 4) != StringRef(ProvenanceMagic, 4)) {
+    err = "not a provenance log";
+    return false;
+  }
+  p += 4;
+
+  auto need = [&](size_t n) -> bool {
+    if ((size_t)(end - p) >= n)
+      return true;
+    err = "truncated provenance log";
+    return false;
+  };
+  strings.assign(1, "");
+  values.assign(1, ValueDesc{0, 0});
+
+  while (p < end) {
+    char tag = *p++;
+    if (tag == 'S') {
+      if (!need(8)) return false;
+      uint32_t id = support::endian::read32le(p);
+      uint32_t len = support::endian::read32le(p + 4);
+      p += 8;
+      if (!need(len)) return false;
+      /* The ids are assigned in sequence as the records are written */
+      if (id != strings.size()) {
+        err = "corrupted provenance log";
+        return false;
+      }
+      strings.push_back(std::string(p, len));
+      p += len;
+    } else if (tag == 'V') {
+      if (!need(12)) return false;
+      uint32_t id = support::endian::read32le(p);
+      ValueDesc desc{support::endian::read32le(p + 4), support::endian::read32le(p + 8)};
+      /* The strings of a value are written before it */
+      if (id != values.size() || desc.function >= strings.size() || desc.description >= strings.size()) {
+        err = "corrupted provenance log";
+        return false;
+      }
+      values.push_back(desc);
+      p += 12;
+    } else if (tag == 'R') {
+      if (!need(8)) return false;
+      uint32_t value = support::endian::read32le(p + 4);
+      if (value >= values.size()) {
+        err = "corrupted provenance log";
+        return false;
+      }
+      roots[support::endian::read32le(p)] = value;
+      p += 8;
+    } else if (tag == 'E') {
+      if (!need(15)) return false;
+      Edge e;
+      e.kind = static_cast<ProvenanceEdge>(*p);
+      e.src = support::endian::read32le(p + 1);
+      e.dst = support::endian::read32le(p + 5);
+      e.root = support::endian::read32le(p + 9);
+      e.distance = support::endian::read16le(p + 13);
+      if (e.src >= values.size() || e.dst >= values.size()) {
+        err = "corrupted provenance log";
+        return false;
+      }
+      edges.push_back(e);
+      p += 15;
+    } else {
+      err = "corrupted provenance log";
+      return false;
+    }
+  }
+  return true;
+}
+
+
+std::string ProvenanceLogContents::describeValue(uint32_t id) const
+{
+  if (id == 0 || id >= values.size())
+    return "<none>";
+  const ValueDesc& vd = values[id];
+  std::string res;
+  if (vd.function && vd.function < strings.size())
+    res = strings[vd.function] + ": ";
+  if (vd.description >= strings.size())
+    return res + "<invalid>";
+  return res + strings[vd.description];
+}
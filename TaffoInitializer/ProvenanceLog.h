@@ -0,0 +1,90 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Value.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+#ifndef __TAFFO_PROVENANCE_LOG_H__
+#define __TAFFO_PROVENANCE_LOG_H__
+
+
+namespace taffo {
+
+
+/* Why a value was enqueued in the conversion queue */
+enum class ProvenanceEdge : uint8_t {
+  LocalAnnotation = 0,
+  GlobalAnnotation,
+  FunctionAnnotation,
+  User,
+  Backtracking,
+  Allocation,
+  ClonedArgument,
+  ClonedAlloca,
+  MemTransfer,
+  NumEdgeKinds
+};
+
+const char *getProvenanceEdgeName(ProvenanceEdge kind);
+
+
+/* Opt-in log of every enqueue performed while building the conversion
+ * queues, used to find the annotations responsible for queue blowups.
+ *
+ * The log is a little-endian binary stream of tagged records:
+ *   'S' id:u32 len:u32 bytes      string table entry
+ *   'V' id:u32 func:u32 desc:u32  value (func is 0 for globals)
+ *   'R' root:u32 value:u32        annotation root
+ *   'E' kind:u8 src:u32 dst:u32 root:u32 distance:u16
+ * Value 0 stands for "no value" in the src field. */
+class ProvenanceLog {
+public:
+  static std::unique_ptr<ProvenanceLog> create(llvm::StringRef filename, std::string& err);
+
+  void logRoot(uint32_t root, llvm::Value *v);
+  void logEdge(ProvenanceEdge kind, llvm::Value *src, llvm::Value *dst, uint32_t root, uint16_t distance);
+
+private:
+  std::unique_ptr<llvm::raw_fd_ostream> os;
+  llvm::DenseMap<const llvm::Value *, uint32_t> valueIDs;
+  llvm::StringMap<uint32_t> stringIDs;
+
+  ProvenanceLog(std::unique_ptr<llvm::raw_fd_ostream> os);
+  uint32_t getValueID(llvm::Value *v);
+  uint32_t getStringID(llvm::StringRef s);
+};
+
+
+/* Decoded contents of a provenance log */
+struct ProvenanceLogContents {
+  struct ValueDesc {
+    uint32_t function;
+    uint32_t description;
+  };
+  struct Edge {
+    ProvenanceEdge kind;
+    uint32_t src;
+    uint32_t dst;
+    uint32_t root;
+    uint16_t distance;
+  };
+
+  /* Indexed by id; entry 0 is unused */
+  std::vector<std::string> strings;
+  std::vector<ValueDesc> values;
+  llvm::DenseMap<uint32_t, uint32_t> roots;
+  std::vector<Edge> edges;
+
+  bool read(llvm::StringRef filename, std::string& err);
+  std::string describeValue(uint32_t id) const;
+};
+
+
+}
+
+
+#endif // __TAFFO_PROVENANCE_LOG_H__
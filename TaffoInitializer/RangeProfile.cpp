@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "TaffoInitializerPass.h"
+
+
+using namespace llvm;
+using namespace taffo;
+using namespace mdutils;
+
+
+STATISTIC(ProfiledValues, "Number of values instrumented for range profiling");
+STATISTIC(ProfiledRoots, "Number of annotation ranges narrowed from a profile");
+
+
+/* Range profiling.
+ * -taffo-init-profile-gen instruments the module so that the program records
+ * the minimum and maximum of every annotated root and of every propagated
+ * scalar float value, and appends them to a text profile at exit, one line
+ *   <key> <min> <max>
+ * per value that was reached, with the bounds as hexadecimal floats. For a
+ * root in memory (an alloca or a global) the values stored into it and
+ * loaded from it are recorded. The keys identify the values by position in
+ * the unmodified module, so the profile applies to the same input of the
+ * initializer.
+ * -taffo-init-profile-use reads such a profile (merging repeated keys, for
+ * multiple runs or modules) and narrows the ranges of the roots to the
+ * recorded ones, widened by a margin, never beyond the annotated range. */
+
+
+std::string TaffoInitializer::getProfileKey(Value *v)
+{
+  if (GlobalValue *gv = dyn_cast<GlobalValue>(v))
+    return ("@" + gv->getName()).str();
+  if (Argument *arg = dyn_cast<Argument>(v))
+    return (arg->getParent()->getName() + ":arg" + Twine(arg->getArgNo())).str();
+
+  Instruction *inst = cast<Instruction>(v);
+  Function *f = inst->getFunction();
+  if (ctx->numberedFunctions.insert(f).second) {
+    unsigned n = 0;
+    for (Instruction& i: instructions(f))
+      ctx->instructionNumbers[&i] = n++;
+  }
+  return (f->getName() + ":" + Twine(ctx->instructionNumbers.lookup(inst))).str();
+}
+
+
+/* Object a pointer points into, looking through casts and GEPs */
+static Value *getPointedObject(Value *ptr)
+{
+  while (true) {
+    ptr = ptr->stripPointerCasts();
+    if (GEPOperator *gep = dyn_cast<GEPOperator>(ptr))
+      ptr = gep->getPointerOperand();
+    else
+      return ptr;
+  }
+}
+
+
+static bool isProfilableType(Type *t)
+{
+  return t->isFloatingPointTy() && !t->isPPC_FP128Ty();
+}
+
+
+static Value *getOrDeclareFunction(Module &m, StringRef name, FunctionType *ty)
+{
+  Function *f = m.getFunction(name);
+  if (!f)
+    return Function::Create(ty, GlobalValue::ExternalLinkage, name, &m);
+  if (f->getFunctionType() == ty)
+    return f;
+  return ConstantExpr::getBitCast(f, ty->getPointerTo());
+}
+
+
+void TaffoInitializer::instrumentRanges(Module &m, ConvQueueT& roots, ConvQueueT& vals)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  /* The keys are computed before any instruction is inserted */
+  struct Site {
+    Value *value;
+    Instruction *insertBefore;
+    unsigned slot;
+  };
+  std::vector<Site> sites;
+  std::vector<std::string> keys;
+  DenseMap<Value *, unsigned> rootSlots;
+
+  for (auto RI = roots.begin(); RI != roots.end(); ++RI) {
+    Value *r = RI->first;
+    if (rootSlots.count(r))
+      continue;
+    rootSlots[r] = keys.size();
+    keys.push_back(getProfileKey(r));
+  }
+
+  for (auto VVI = vals.begin(); VVI != vals.end(); ++VVI) {
+    Instruction *inst = dyn_cast<Instruction>(VVI->first);
+    if (!inst)
+      continue;
+
+    /* Values stored into or loaded from the memory of a root */
+    Value *ptr = nullptr, *data = inst;
+    if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+      ptr = store->getPointerOperand();
+      data = store->getValueOperand();
+    } else if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+      ptr = load->getPointerOperand();
+    }
+    if (!isProfilableType(data->getType()))
+      continue;
+    if (ptr) {
+      Value *obj = getPointedObject(ptr);
+      /* Heap buffers are reached through the pointer slot */
+      if (LoadInst *slotLoad = dyn_cast<LoadInst>(obj))
+        if (!rootSlots.count(obj))
+          obj = getPointedObject(slotLoad->getPointerOperand());
+      auto RS = rootSlots.find(obj);
+      if (RS != rootSlots.end())
+        sites.push_back({data, isa<StoreInst>(inst) ? inst : inst->getNextNode(), RS->second});
+    }
+    if (isa<StoreInst>(inst) || isa<InvokeInst>(inst))
+      continue;
+
+    unsigned slot;
+    auto RS = rootSlots.find(inst);
+    if (RS != rootSlots.end()) {
+      slot = RS->second;
+    } else {
+      slot = keys.size();
+      keys.push_back(getProfileKey(inst));
+    }
+    Instruction *insertBefore = inst->getNextNode();
+    if (isa<PHINode>(inst))
+      insertBefore = &*inst->getParent()->getFirstInsertionPt();
+    sites.push_back({inst, insertBefore, slot});
+  }
+  if (keys.empty())
+    return;
+
+  LLVMContext &c = m.getContext();
+  Type *doubleTy = Type::getDoubleTy(c);
+  Type *i8p = Type::getInt8PtrTy(c);
+  Type *i64 = Type::getInt64Ty(c);
+  ArrayType *tableTy = ArrayType::get(doubleTy, keys.size());
+  ArrayType *keysTy = ArrayType::get(i8p, keys.size());
+
+  auto *minTable = new GlobalVariable(m, tableTy, false, GlobalValue::InternalLinkage,
+      ConstantArray::get(tableTy, std::vector<Constant *>(keys.size(), ConstantFP::getInfinity(doubleTy, false))),
+      "__taffo_prof_min");
+  auto *maxTable = new GlobalVariable(m, tableTy, false, GlobalValue::InternalLinkage,
+      ConstantArray::get(tableTy, std::vector<Constant *>(keys.size(), ConstantFP::getInfinity(doubleTy, true))),
+      "__taffo_prof_max");
+  std::vector<Constant *> keyPtrs;
+  Constant *zeros[] = {ConstantInt::get(i64, 0), ConstantInt::get(i64, 0)};
+  for (const std::string& key: keys) {
+    Constant *str = ConstantDataArray::getString(c, key);
+    auto *strVar = new GlobalVariable(m, str->getType(), true, GlobalValue::PrivateLinkage, str, "__taffo_prof_key");
+    strVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    keyPtrs.push_back(ConstantExpr::getInBoundsGetElementPtr(str->getType(), strVar, zeros));
+  }
+  auto *keyTable = new GlobalVariable(m, keysTy, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(keysTy, keyPtrs), "__taffo_prof_keys");
+
+  /* min = minnum(min, v); max = maxnum(max, v) */
+  for (Site& s: sites) {
+    IRBuilder<> b(s.insertBefore);
+    Value *v = s.value;
+    if (v->getType()->getPrimitiveSizeInBits() < 64)
+      v = b.CreateFPExt(v, doubleTy);
+    else if (!v->getType()->isDoubleTy())
+      v = b.CreateFPTrunc(v, doubleTy);
+    Value *idx[] = {b.getInt64(0), b.getInt64(s.slot)};
+    Value *minPtr = b.CreateInBoundsGEP(tableTy, minTable, idx);
+    Value *maxPtr = b.CreateInBoundsGEP(tableTy, maxTable, idx);
+    b.CreateStore(b.CreateMinNum(b.CreateLoad(doubleTy, minPtr), v), minPtr);
+    b.CreateStore(b.CreateMaxNum(b.CreateLoad(doubleTy, maxPtr), v), maxPtr);
+    ProfiledValues++;
+  }
+
+  /* Dump function, run from the global destructors:
+   *   f = fopen(file, "a");
+   *   for (i = 0; i < n; i++)
+   *     if (min[i] <= max[i]) fprintf(f, "%s %a %a\n", keys[i], min[i], max[i]);
+   *   fclose(f); */
+  Type *i32 = Type::getInt32Ty(c);
+  FunctionType *fopenTy = FunctionType::get(i8p, {i8p, i8p}, false);
+  FunctionType *fprintfTy = FunctionType::get(i32, {i8p, i8p}, true);
+  FunctionType *fcloseTy = FunctionType::get(i32, {i8p}, false);
+  Value *fopenF = getOrDeclareFunction(m, "fopen", fopenTy);
+  Value *fprintfF = getOrDeclareFunction(m, "fprintf", fprintfTy);
+  Value *fcloseF = getOrDeclareFunction(m, "fclose", fcloseTy);
+
+  Function *dump = Function::Create(FunctionType::get(Type::getVoidTy(c), false),
+      GlobalValue::InternalLinkage, "__taffo_prof_dump", &m);
+  BasicBlock *entry = BasicBlock::Create(c, "entry", dump);
+  BasicBlock *loop = BasicBlock::Create(c, "loop", dump);
+  BasicBlock *print = BasicBlock::Create(c, "print", dump);
+  BasicBlock *latch = BasicBlock::Create(c, "latch", dump);
+  BasicBlock *close = BasicBlock::Create(c, "close", dump);
+  BasicBlock *exit = BasicBlock::Create(c, "exit", dump);
+
+  IRBuilder<> b(entry);
+  Value *file = b.CreateCall(fopenTy, fopenF, {b.CreateGlobalStringPtr(options.profileRuntimeFile), b.CreateGlobalStringPtr("a")});
+  Value *format = b.CreateGlobalStringPtr("%s %a %a\n");
+  b.CreateCondBr(b.CreateIsNull(file), exit, loop);
+
+  b.SetInsertPoint(loop);
+  PHINode *i = b.CreatePHI(i64, 2);
+  i->addIncoming(b.getInt64(0), entry);
+  Value *idx[] = {b.getInt64(0), i};
+  Value *min = b.CreateLoad(doubleTy, b.CreateInBoundsGEP(tableTy, minTable, idx));
+  Value *max = b.CreateLoad(doubleTy, b.CreateInBoundsGEP(tableTy, maxTable, idx));
+  b.CreateCondBr(b.CreateFCmpOLE(min, max), print, latch);
+
+  b.SetInsertPoint(print);
+  Value *key = b.CreateLoad(i8p, b.CreateInBoundsGEP(keysTy, keyTable, idx));
+  b.CreateCall(fprintfTy, fprintfF, {file, format, key, min, max});
+  b.CreateBr(latch);
+
+  b.SetInsertPoint(latch);
+  Value *next = b.CreateAdd(i, b.getInt64(1));
+  i->addIncoming(next, latch);
+  b.CreateCondBr(b.CreateICmpEQ(next, b.getInt64(keys.size())), close, loop);
+
+  b.SetInsertPoint(close);
+  b.CreateCall(fcloseTy, fcloseF, {file});
+  b.CreateBr(exit);
+
+  b.SetInsertPoint(exit);
+  b.CreateRetVoid();
+
+  appendToGlobalDtors(m, dump, 0);
+  LLVM_DEBUG(dbgs() << "instrumented " << sites.size() << " sites for " << keys.size() << " values\n");
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
+
+
+void TaffoInitializer::applyRangeProfile(ConvQueueT& roots)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(options.profileUseFile);
+  if (!buf) {
+    errs() << "taffo-init: cannot read the range profile " << options.profileUseFile << ": "
+           << buf.getError().message() << "\n";
+    return;
+  }
+
+  StringMap<Range> profile;
+  for (line_iterator line(**buf, true, '#'); !line.is_at_end(); ++line) {
+    StringRef rest = *line, key, minStr, maxStr;
+    std::tie(rest, maxStr) = rest.rtrim().rsplit(' ');
+    std::tie(key, minStr) = rest.rsplit(' ');
+    if (key.empty() || minStr.empty() || maxStr.empty())
+      continue;
+    double min = std::strtod(minStr.str().c_str(), nullptr);
+    double max = std::strtod(maxStr.str().c_str(), nullptr);
+    auto ins = profile.insert(std::make_pair(key, Range(min, max)));
+    if (!ins.second) {
+      ins.first->second.Min = std::min(ins.first->second.Min, min);
+      ins.first->second.Max = std::max(ins.first->second.Max, max);
+    }
+  }
+
+  for (auto RI = roots.begin(); RI != roots.end(); ++RI) {
+    InputInfo *ii = dyn_cast_or_null<InputInfo>(RI->second.metadata.get());
+    if (!ii || !ii->IRange)
+      continue;
+    auto found = profile.find(getProfileKey(RI->first));
+    if (found == profile.end())
+      continue;
+
+    const Range& measured = found->second;
+    double margin = (measured.Max - measured.Min) * options.profileMargin;
+    double min = std::max(ii->IRange->Min, measured.Min - margin);
+    double max = std::min(ii->IRange->Max, measured.Max + margin);
+    if (!(min <= max) || (min == ii->IRange->Min && max == ii->IRange->Max))
+      continue;
+
+    InputInfo *nii = cast<InputInfo>(ii->clone());
+    nii->IRange.reset(new Range(min, max));
+    RI->second.metadata.reset(nii);
+    ProfiledRoots++;
+    LLVM_DEBUG(dbgs() << "profiled range [" << min << ", " << max << "] for " << *RI->first << "\n");
+
+    for (DeclarationRecord& decl: ctx->declarations) {
+      if (decl.value != RI->first)
+        continue;
+      FixedPointTypeGenError err;
+      FPType fixedPoint = fixedPointTypeFromRange(*nii->IRange, &err, ctx->options.totalBits, ctx->options.fracThreshold, 64, ctx->options.totalBits);
+      if (err == FixedPointTypeGenError::InvalidRange)
+        continue;
+      decl.integerPart = std::abs((int)fixedPoint.getWidth()) - fixedPoint.getPointPos();
+      decl.fractionalPart = fixedPoint.getPointPos();
+    }
+  }
+}
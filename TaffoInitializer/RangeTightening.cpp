@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+
+
+using namespace llvm;
+using namespace taffo;
+using namespace mdutils;
+
+
+STATISTIC(RangesTightened, "Number of propagated ranges narrowed from constants");
+
+
+/* Range tightening (-taffo-init-tighten-ranges).
+ * The propagation copies the range of the root to every value it reaches.
+ * For values computed from a single propagated operand and a constant, the
+ * range of the operand transformed by the constant is a sharper seed; it
+ * replaces the copied range only when it is contained in it, so that this
+ * stage never widens anything. The actual range analysis is left to VRA. */
+
+
+/* A scalar constant, or a vector constant with the same value in every
+ * lane */
+static bool getConstantOperand(Value *v, double& res)
+{
+  Constant *c = dyn_cast<Constant>(v);
+  if (!c)
+    return false;
+  if (c->getType()->isVectorTy())
+    c = c->getSplatValue();
+  ConstantFP *cfp = dyn_cast_or_null<ConstantFP>(c);
+  if (!cfp)
+    return false;
+  APFloat val = cfp->getValueAPF();
+  bool losesInfo;
+  val.convert(APFloat::IEEEdouble(), APFloat::rmNearestTiesToEven, &losesInfo);
+  res = val.convertToDouble();
+  return std::isfinite(res);
+}
+
+
+/* Range of "x op c" (or "c op x" when constantFirst) for x in r */
+static bool applyConstant(unsigned opcode, const Range& r, double c, bool constantFirst, Range& res)
+{
+  double a, b;
+  switch (opcode) {
+    case Instruction::FAdd:
+      a = r.Min + c;
+      b = r.Max + c;
+      break;
+    case Instruction::FSub:
+      if (constantFirst) {
+        a = c - r.Max;
+        b = c - r.Min;
+      } else {
+        a = r.Min - c;
+        b = r.Max - c;
+      }
+      break;
+    case Instruction::FMul:
+      a = r.Min * c;
+      b = r.Max * c;
+      break;
+    case Instruction::FDiv:
+      if (constantFirst) {
+        if (r.Min <= 0 && r.Max >= 0)
+          return false;
+        a = c / r.Min;
+        b = c / r.Max;
+      } else {
+        if (c == 0)
+          return false;
+        a = r.Min / c;
+        b = r.Max / c;
+      }
+      break;
+    default:
+      return false;
+  }
+  res.Min = std::min(a, b);
+  res.Max = std::max(a, b);
+  return std::isfinite(res.Min) && std::isfinite(res.Max);
+}
+
+
+static const Range *getQueuedRange(TaffoInitializer::ConvQueueT& vals, Value *v)
+{
+  auto VI = vals.find(v);
+  if (VI == vals.end())
+    return nullptr;
+  InputInfo *ii = dyn_cast_or_null<InputInfo>(VI->second.metadata.get());
+  return ii ? ii->IRange.get() : nullptr;
+}
+
+
+void TaffoInitializer::tightenRangesFromConstants(ConvQueueT& vals)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  /* Users follow the values they use in the queue, so the narrowed range
+   * of an operand is already available when its users are visited */
+  for (auto VVI = vals.begin(); VVI != vals.end(); ++VVI) {
+    Instruction *inst = dyn_cast<Instruction>(VVI->first);
+    ValueInfo& vi = VVI->second;
+    InputInfo *ii = dyn_cast_or_null<InputInfo>(vi.metadata.get());
+    if (!inst || !ii || !ii->IRange || ii->IFinal || vi.fixpTypeRootDistance == 0)
+      continue;
+
+    Range tight;
+    bool found = false;
+    if (isa<BinaryOperator>(inst)) {
+      double c;
+      const Range *r;
+      if (getConstantOperand(inst->getOperand(1), c) && (r = getQueuedRange(vals, inst->getOperand(0))))
+        found = applyConstant(inst->getOpcode(), *r, c, false, tight);
+      else if (getConstantOperand(inst->getOperand(0), c) && (r = getQueuedRange(vals, inst->getOperand(1))))
+        found = applyConstant(inst->getOpcode(), *r, c, true, tight);
+    } else if (isa<FPExtInst>(inst) || isa<FPTruncInst>(inst)) {
+      if (const Range *r = getQueuedRange(vals, inst->getOperand(0))) {
+        tight = *r;
+        found = true;
+      }
+    }
+    if (!found)
+      continue;
+
+    const Range& cur = *ii->IRange;
+    if (tight.Min < cur.Min || tight.Max > cur.Max || (tight.Min == cur.Min && tight.Max == cur.Max))
+      continue;
+
+    /* The metadata may be shared with the value it was copied from */
+    InputInfo *nii = cast<InputInfo>(ii->clone());
+    nii->IRange.reset(new Range(tight.Min, tight.Max));
+    vi.metadata.reset(nii);
+    RangesTightened++;
+    LLVM_DEBUG(dbgs() << "tightened " << *inst << " to [" << tight.Min << ", " << tight.Max << "]\n");
+  }
+
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
+
+
+/* A global with local linkage whose address is only used to load from it
+ * holds its initializer for the whole execution */
+bool TaffoInitializer::isNeverWritten(GlobalVariable *gv)
+{
+  if (!gv->hasLocalLinkage())
+    return false;
+  /* All the functions which may store to it must be visible */
+  if (materializer)
+    materializer->materializeReferencing(*gv);
+
+  SmallVector<Value *, 8> worklist(1, gv);
+  SmallPtrSet<Value *, 8> visited;
+  while (!worklist.empty()) {
+    Value *ptr = worklist.pop_back_val();
+    if (!visited.insert(ptr).second)
+      continue;
+    for (User *u: ptr->users()) {
+      if (isa<LoadInst>(u))
+        continue;
+      if (isa<GEPOperator>(u) || isa<BitCastOperator>(u) || isa<ConstantAggregate>(u)) {
+        worklist.push_back(u);
+        continue;
+      }
+      /* llvm.global.annotations refers to the global as well */
+      if (GlobalObject *ugo = dyn_cast<GlobalObject>(u)) {
+        if (ugo->hasSection() && ugo->getSection() == "llvm.metadata")
+          continue;
+      }
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+STATISTIC(FunctionsStreamed, "Number of function queues processed and released in streaming mode");
+
+
+/* Streaming mode.
+ * The conversion queue of the module is split by function after the
+ * propagation from the annotations; only the values outside the functions
+ * (globals and constants) stay in the module queue. The functions are then
+ * processed one at a time, callers first: their calls are specialized, the
+ * metadata of their arguments is set and their queue is released. The
+ * clones get a queue of their own, processed right after the function which
+ * created them, so that the queues of the clones are not accumulated over
+ * the module: only those along the current chain of calls are kept.
+ * This does not bound the memory to the largest function. The propagation
+ * from the annotations and the metadata of the original functions are still
+ * computed over the whole module before streaming starts, since the roots in
+ * globals can reach any function; the split moves the entries without
+ * copying them, so the peak is at least the queue of the whole module. What
+ * is bounded is the growth due to the clones. */
+
+
+static Function *getParentFunction(Value *v)
+{
+  if (Instruction *inst = dyn_cast<Instruction>(v))
+    return inst->getFunction();
+  if (Argument *arg = dyn_cast<Argument>(v))
+    return arg->getParent();
+  return nullptr;
+}
+
+
+/* The calls of a function look up their arguments in its queue; those
+ * which are globals or constants are copied from the module queue */
+static void addResidentOperands(TaffoInitializer::ConvQueueT& q, TaffoInitializer::ConvQueueT& resident)
+{
+  for (auto V = q.begin(); V != q.end(); ++V) {
+    if (!(isa<CallInst>(V->first) || isa<InvokeInst>(V->first)))
+      continue;
+    for (Value *op: cast<User>(V->first)->operands()) {
+      if (getParentFunction(op) || q.count(op))
+        continue;
+      auto R = resident.find(op);
+      if (R != resident.end())
+        q.push_back(op, R->second);
+    }
+  }
+}
+
+
+void TaffoInitializer::streamFunctionSpace(Module &m, ConvQueueT& vals, ConvQueueT& global)
+{
+  LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
+
+  /* The whole queue is alive before the split */
+  ctx->peakQueueSize = vals.size();
+  DenseMap<Function *, std::unique_ptr<ConvQueueT>> queues;
+  size_t remaining = 0;
+  for (auto V = vals.begin(); V != vals.end();) {
+    Function *f = getParentFunction(V->first);
+    if (!f) {
+      ++V;
+      continue;
+    }
+    std::unique_ptr<ConvQueueT>& q = queues[f];
+    if (!q)
+      q.reset(new ConvQueueT());
+    q->push_back(V->first, V->second);
+    V = vals.erase(V);
+    remaining++;
+  }
+
+  /* The call graph SCCs come bottom-up */
+  std::vector<Function *> order;
+  CallGraph cg(m);
+  for (auto SCC = scc_begin(&cg); !SCC.isAtEnd(); ++SCC) {
+    for (CallGraphNode *node: *SCC) {
+      Function *f = node->getFunction();
+      if (f && queues.count(f))
+        order.push_back(f);
+    }
+  }
+  std::reverse(order.begin(), order.end());
+  if (order.size() < queues.size()) {
+    SmallPtrSet<Function *, 32> ordered(order.begin(), order.end());
+    for (auto& q: queues) {
+      if (!ordered.count(q.first))
+        order.push_back(q.first);
+    }
+  }
+
+  SmallPtrSet<Function *, 32> processed;
+  auto process = [&](Function *f, ConvQueueT& q) {
+    LLVM_DEBUG(dbgs() << "streaming " << f->getName() << ", " << q.size() << " values\n");
+    addResidentOperands(q, vals);
+    SmallPtrSet<Function *, 10> callTrace;
+    generateFunctionSpace(q, global, callTrace);
+    setFunctionArgsMetadata(*f, q);
+    processed.insert(f);
+
+    size_t pending = 0;
+    for (auto& clone: ctx->pendingQueues)
+      pending += clone.second->size();
+    ctx->peakQueueSize = std::max(ctx->peakQueueSize, vals.size() + remaining + q.size() + pending);
+    ctx->conversionQueueSize += q.size();
+    FunctionsStreamed++;
+  };
+
+  for (Function *f: order) {
+    std::unique_ptr<ConvQueueT> q = std::move(queues[f]);
+    remaining -= q->size();
+    process(f, *q);
+    q.reset();
+    queues.erase(f);
+
+    /* Depth first, so that the pending queues are those of the clones along
+     * a chain of calls */
+    while (!ctx->pendingQueues.empty()) {
+      std::pair<Function *, std::unique_ptr<ConvQueueT>> clone = std::move(ctx->pendingQueues.back());
+      ctx->pendingQueues.pop_back();
+      process(clone.first, *clone.second);
+    }
+  }
+
+  for (Function &f: m.functions()) {
+    if (!processed.count(&f))
+      setFunctionArgsMetadata(f, vals);
+  }
+  ctx->conversionQueueSize += vals.size();
+
+  LLVM_DEBUG(dbgs() << "peak queue size " << ctx->peakQueueSize << ", " << ctx->conversionQueueSize << " values processed\n");
+  LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
+}
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <climits>
+#include <fstream>
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
@@ -7,6 +8,7 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
@@ -14,9 +16,12 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Path.h"
 #include <llvm/Transforms/Utils/ValueMapper.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+#include "AnnotationDatabase.h"
 #include "TypeUtils.h"
 #include "Metadata.h"
 
@@ -27,6 +32,14 @@ using namespace taffo;
 
 char TaffoInitializer::ID = 0;
 
+constexpr TargetNameTable::ID TargetNameTable::None;
+constexpr ValueInfo::DepthT ValueInfo::UnboundedBacktracking;
+constexpr ValueInfo::DepthT ValueInfo::UnknownRootDistance;
+constexpr ValueInfo::RootID ValueInfo::NoRoot;
+
+STATISTIC(ModulesSkipped, "Number of modules without annotations left untouched");
+
+
 static RegisterPass<TaffoInitializer> X(
   "taffoinit",
   "TAFFO Framework Initialization Stage",
@@ -36,43 +49,323 @@ static RegisterPass<TaffoInitializer> X(
 
 llvm::cl::opt<bool> ManualFunctionCloning("manualclone",
     llvm::cl::desc("Enables function cloning only for annotated functions"), llvm::cl::init(false));
+llvm::cl::opt<int> FracThreshold2("minfractbits2", llvm::cl::value_desc("bits"),
+    llvm::cl::desc("Threshold of fractional bits in fixed point numbers"), llvm::cl::init(3));
+llvm::cl::opt<int> TotalBits2("totalbits2", llvm::cl::value_desc("bits"),
+    llvm::cl::desc("Total amount of bits in fixed point numbers"), llvm::cl::init(32));
+llvm::cl::opt<std::string> DeclarationsFile("taffo-init-declarations", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Output file of the declarations (%m expands to the module name)"), llvm::cl::init("declarations"));
+llvm::cl::opt<uint64_t> BacktrackingRootBudget("taffo-init-bt-root-budget", llvm::cl::value_desc("operands"),
+    llvm::cl::desc("Maximum number of operands visited while backtracking from a single annotation (0 = unlimited)"), llvm::cl::init(50000));
+llvm::cl::opt<uint64_t> BacktrackingModuleBudget("taffo-init-bt-module-budget", llvm::cl::value_desc("operands"),
+    llvm::cl::desc("Maximum number of operands visited while backtracking in the whole module (0 = unlimited)"), llvm::cl::init(1000000));
+llvm::cl::opt<bool> EstimateOnly("taffo-init-estimate",
+    llvm::cl::desc("Only predict the conversion queue size and the cloning cost, without modifying the module"), llvm::cl::init(false));
+llvm::cl::opt<std::string> EstimateFile("taffo-init-estimate-out", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Output file of the estimation report (%m expands to the module name)"), llvm::cl::init("-"));
+llvm::cl::opt<unsigned> DevirtualizationTargets("taffo-init-devirt-targets", llvm::cl::value_desc("calls"),
+    llvm::cl::desc("Maximum number of speculative direct calls an indirect call is rewritten into (0 = disabled)"), llvm::cl::init(4));
+llvm::cl::opt<bool> UnifyLoopFormats("taffo-init-unify-loop-formats",
+    llvm::cl::desc("Propose a common fixed point format for the values used together in a loop nest"), llvm::cl::init(false));
+llvm::cl::opt<unsigned> LoopFormatMaxFracLoss("taffo-init-unify-max-frac-loss", llvm::cl::value_desc("bits"),
+    llvm::cl::desc("Maximum number of fractional bits a value may lose to share the format of its loop nest"), llvm::cl::init(8));
+llvm::cl::opt<bool> ProfileGenerate("taffo-init-profile-gen",
+    llvm::cl::desc("Instrument the annotated values to record their ranges at run time, instead of producing metadata"), llvm::cl::init(false));
+llvm::cl::opt<std::string> ProfileRuntimeFile("taffo-init-profile-file", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("File the instrumented program appends the recorded ranges to"), llvm::cl::init("taffo-ranges.prof"));
+llvm::cl::opt<std::string> ProfileUseFile("taffo-init-profile-use", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Narrow the ranges of the annotations to those recorded in this profile"));
+llvm::cl::opt<double> ProfileMargin("taffo-init-profile-margin", llvm::cl::value_desc("fraction"),
+    llvm::cl::desc("Widen the recorded ranges by this fraction of their width"), llvm::cl::init(0.1));
+llvm::cl::opt<bool> TightenRanges("taffo-init-tighten-ranges",
+    llvm::cl::desc("Narrow the propagated ranges using constant operands and initializers"), llvm::cl::init(false));
+llvm::cl::list<std::string> AllocationFunctions("taffo-init-alloc-fn", llvm::cl::value_desc("function"),
+    llvm::cl::desc("Treat the given function as a heap allocator returning a fresh buffer"), llvm::cl::CommaSeparated);
+llvm::cl::opt<std::string> AnnotationDatabaseFile("taffo-init-annotation-db", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Apply the precompiled annotations in this database (built with taffo-init-annotation-db)"));
+llvm::cl::opt<std::string> AnnotationProfilesFile("taffo-init-annotation-profiles", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Read the annotation profiles referenced with profile('name') from this file"));
+llvm::cl::opt<std::string> SummaryFile("taffo-init-summary-out", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Write the summary of the annotated calls to other modules for taffo-init-thinlink (%m expands to the module name)"));
+llvm::cl::opt<std::string> ThinLinkDecisionsFile("taffo-init-thinlink-decisions", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Apply the cross-module specializations decided by taffo-init-thinlink"));
+llvm::cl::opt<bool> CleanupClones("taffo-init-cleanup",
+    llvm::cl::desc("Merge the identical clones and remove the specialized functions left unused"), llvm::cl::init(true));
+llvm::cl::opt<bool> Streaming("taffo-init-streaming",
+    llvm::cl::desc("Give each clone its own conversion queue, released once the clone is processed (the queue of the original functions is still built for the whole module)"), llvm::cl::init(false));
+llvm::cl::opt<std::string> ProvenanceFile("taffo-init-provenance", llvm::cl::value_desc("filename"),
+    llvm::cl::desc("Log the reason of every enqueue in the conversion queue to this file (%m expands to the module name)"));
+
+TaffoInitializerOptions TaffoInitializerOptions::fromCommandLine()
+{
+  TaffoInitializerOptions opts;
+  opts.fracThreshold = FracThreshold2;
+  opts.totalBits = TotalBits2;
+  opts.manualFunctionCloning = ManualFunctionCloning;
+  opts.backtrackingRootBudget = BacktrackingRootBudget;
+  opts.backtrackingModuleBudget = BacktrackingModuleBudget;
+  opts.declarationsFile = DeclarationsFile;
+  opts.provenanceFile = ProvenanceFile;
+  opts.estimateOnly = EstimateOnly;
+  opts.estimateFile = EstimateFile;
+  opts.tightenRanges = TightenRanges;
+  opts.profileGenerate = ProfileGenerate;
+  opts.profileRuntimeFile = ProfileRuntimeFile;
+  opts.profileUseFile = ProfileUseFile;
+  opts.profileMargin = ProfileMargin;
+  opts.unifyLoopFormats = UnifyLoopFormats;
+  opts.loopFormatMaxFracLoss = LoopFormatMaxFracLoss;
+  opts.devirtualizationTargets = DevirtualizationTargets;
+  opts.allocationFunctions.assign(AllocationFunctions.begin(), AllocationFunctions.end());
+  opts.annotationDatabaseFile = AnnotationDatabaseFile;
+  opts.annotationProfilesFile = AnnotationProfilesFile;
+  opts.summaryFile = SummaryFile;
+  opts.thinLinkDecisionsFile = ThinLinkDecisionsFile;
+  opts.cleanupClones = CleanupClones;
+  opts.streaming = Streaming;
+  return opts;
+}
+
+
+std::string TaffoInitializerOptions::fileNameFor(const std::string &pattern, const Module &m)
+{
+  std::string res = pattern;
+  size_t pos = res.find("%m");
+  if (pos != std::string::npos)
+    res.replace(pos, 2, sys::path::stem(m.getModuleIdentifier()).str());
+  return res;
+}
 
 
 bool TaffoInitializer::runOnModule(Module &m)
 {
-  DEBUG_WITH_TYPE(DEBUG_ANNOTATION, printAnnotatedObj(m));
+  ctx.reset(new InitializerContext(m, options));
+
+  /* Modules without annotations are not modified at all. Lazily loaded
+   * modules are not checked, since the index needs the function bodies;
+   * neither are those which may get annotations or clones from outside. */
+  bool externalInput = !options.annotationDatabaseFile.empty() || !options.summaryFile.empty() ||
+      !options.thinLinkDecisionsFile.empty();
+  if (!materializer && !externalInput && !options.estimateOnly) {
+    bool empty = annotationIndex ? annotationIndex->empty() : AnnotationIndex::build(m).empty();
+    if (empty) {
+      /* The declarations file is still truncated, so that the later stages
+       * do not read the one of a previous run */
+      writeDeclarations(m);
+      ModulesSkipped++;
+      return false;
+    }
+  }
+
+  if (!options.provenanceFile.empty()) {
+    std::string err;
+    ctx->provenance = ProvenanceLog::create(TaffoInitializerOptions::fileNameFor(options.provenanceFile, m), err);
+    if (!ctx->provenance)
+      errs() << "taffo-init: cannot open the provenance log: " << err << "\n";
+  }
+  if (materializer)
+    materializer->materializeAnnotated();
 
-  // Overwrite declarations file
-  std::remove("declarations");
+  readAnnotationProfiles(m);
+  DEBUG_WITH_TYPE(DEBUG_ANNOTATION, printAnnotatedObj(m));
 
   ConvQueueT local;
   ConvQueueT global;
   readAllLocalAnnotations(m, local);
   readGlobalAnnotations(m, global, true);
   readGlobalAnnotations(m, global, false);
+  if (!options.annotationDatabaseFile.empty()) {
+    std::string err;
+    std::unique_ptr<AnnotationDatabase> db = AnnotationDatabase::open(options.annotationDatabaseFile, err);
+    if (db)
+      readDatabaseAnnotations(m, *db, global, local);
+    else
+      errs() << "taffo-init: cannot open the annotation database: " << err << "\n";
+  }
   
   ConvQueueT rootsa;
   rootsa.insert(rootsa.end(), global.begin(), global.end());
   rootsa.insert(rootsa.end(), local.begin(), local.end());
-  AnnotationCount = rootsa.size();
+  AnnotationCount += rootsa.size();
+  ctx->annotationCount = rootsa.size();
+  if (!options.profileUseFile.empty())
+    applyRangeProfile(rootsa);
+
+  if (options.estimateOnly) {
+    estimateConversion(m, rootsa, global);
+    ctx->provenance.reset();
+    return false;
+  }
 
   ConvQueueT vals;
   buildConversionQueueForRootValues(rootsa, vals);
-  for (auto V: vals) {
+  if (!options.thinLinkDecisionsFile.empty() && readThinLinkDecisions(m))
+    createExportedClones(m, vals, global);
+  if (options.profileGenerate) {
+    instrumentRanges(m, rootsa, vals);
+    ctx->conversionQueueSize = vals.size();
+    ctx->provenance.reset();
+    return true;
+  }
+  if (options.tightenRanges)
+    tightenRangesFromConstants(vals);
+  if (options.unifyLoopFormats)
+    unifyLoopFormats(vals);
+  for (auto V = vals.begin(); V != vals.end(); ++V) {
     setMetadataOfValue(V->first, V->second);
   }
   removeAnnotationCalls(vals);
 
-  SmallPtrSet<Function*, 10> callTrace;
-  generateFunctionSpace(vals, global, callTrace);
+  if (options.streaming) {
+    streamFunctionSpace(m, vals, global);
+  } else {
+    SmallPtrSet<Function*, 10> callTrace;
+    generateFunctionSpace(vals, global, callTrace);
+
+    LLVM_DEBUG(printConversionQueue(vals));
+    setFunctionArgsMetadata(m, vals);
+    ctx->conversionQueueSize = vals.size();
+  }
+  if (options.cleanupClones)
+    cleanupClones(m, vals);
+
+  writeDeclarations(m);
+  if (!options.summaryFile.empty())
+    writeModuleSummary(m);
+  ctx->provenance.reset();
+  return true;
+}
+
+
+OptimizationRemarkEmitter& TaffoInitializer::getRemarkEmitter(const Function *f)
+{
+  std::unique_ptr<OptimizationRemarkEmitter>& ore = ctx->remarkEmitters[f];
+  if (!ore)
+    ore.reset(new OptimizationRemarkEmitter(f));
+  return *ore;
+}
+
+
+ValueInfo::RootID TaffoInitializer::newRoot(Value *v)
+{
+  ValueInfo::RootID root = ++ctx->rootCount;
+  ctx->rootValues.push_back(v);
+  ctx->rootIsFloat.push_back(getTypeSummary(v->getType()).isFloat);
+  if (ctx->provenance)
+    ctx->provenance->logRoot(root, v);
+  return root;
+}
+
+
+const TypeSummary& TaffoInitializer::getTypeSummary(Type *t)
+{
+  auto found = ctx->typeSummaries.find(t);
+  if (found != ctx->typeSummaries.end())
+    return found->second;
+  Type *unwrapped = fullyUnwrapPointerArrayOrVectorType(t);
+  TypeSummary ts = {unwrapped, isFloatType(t) || unwrapped->isFloatingPointTy()};
+  return ctx->typeSummaries.insert(std::make_pair(t, ts)).first->second;
+}
+
 
-  LLVM_DEBUG(printConversionQueue(vals));
-  setFunctionArgsMetadata(m, vals);
+/* Users which neither consume nor produce a float (integer arithmetic and
+ * comparisons, branches, address computations into non-float data) cannot
+ * carry the conversion any further. They are pruned only for values
+ * descending from a float root, since annotated integers must still be
+ * propagated through integer code. */
+bool TaffoInitializer::isFloatCarryingUser(Value *used, const ValueInfo& VIUsed, User *user)
+{
+  /* A lane index says nothing about the range of the vector elements */
+  if (isa<ExtractElementInst>(user) && user->getOperand(1) == used)
+    return false;
+  if (isa<InsertElementInst>(user) && user->getOperand(2) == used)
+    return false;
+  if (VIUsed.root == ValueInfo::NoRoot || !ctx->rootIsFloat[VIUsed.root - 1])
+    return true;
+  if (isa<CallInst>(user) || isa<InvokeInst>(user) || isa<ReturnInst>(user) || isa<StoreInst>(user))
+    return true;
+  return getTypeSummary(used->getType()).isFloat || getTypeSummary(user->getType()).isFloat;
+}
 
+
+/* Charge the operands of inst, visited while backtracking from a value
+ * descending from root. Returns false when the root or the module have run
+ * out of budget, in which case the value must not be extended any further. */
+bool TaffoInitializer::chargeBacktracking(ValueInfo::RootID root, Instruction *inst)
+{
+  uint64_t moduleBudget = options.backtrackingModuleBudget;
+  uint64_t rootBudget = options.backtrackingRootBudget;
+  unsigned visits = inst->getNumOperands();
+
+  bool exhausted = false;
+  if (moduleBudget && ctx->backtrackingVisits + visits > moduleBudget) {
+    if (!ctx->moduleBacktrackingBudgetExhausted) {
+      LLVM_DEBUG(dbgs() << "module backtracking budget of " << moduleBudget
+                        << " operands exhausted in " << ctx->module.getModuleIdentifier() << "\n");
+      ctx->moduleBacktrackingBudgetExhausted = true;
+      getRemarkEmitter(inst->getFunction()).emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "BacktrackingBudget", inst)
+            << "backtracking stopped for the whole module after visiting "
+            << ore::NV("Visits", ctx->backtrackingVisits) << " operands";
+      });
+    }
+    exhausted = true;
+  }
+  uint64_t *rootVisits = nullptr;
+  if (!exhausted && rootBudget && root != ValueInfo::NoRoot) {
+    rootVisits = &ctx->rootBacktrackingVisits[root];
+    exhausted = *rootVisits + visits > rootBudget;
+  }
+
+  if (exhausted) {
+    Value *rootValue = root != ValueInfo::NoRoot ? ctx->rootValues[root - 1] : nullptr;
+    if (rootValue && ctx->cutOffRoots.insert(rootValue).second) {
+      LLVM_DEBUG(dbgs() << "backtracking cut off for annotation root " << *rootValue << "\n");
+      /* Roots which are not instructions (globals, arguments) are reported
+       * where the backtracking stopped */
+      Instruction *at = dyn_cast<Instruction>(rootValue);
+      if (!at)
+        at = inst;
+      getRemarkEmitter(at->getFunction()).emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "BacktrackingBudget", at)
+            << "backtracking from " << ore::NV("Root", rootValue)
+            << " stopped after visiting "
+            << ore::NV("Visits", rootVisits ? *rootVisits : ctx->backtrackingVisits)
+            << " operands";
+      });
+    }
+    return false;
+  }
+
+  if (rootVisits)
+    *rootVisits += visits;
+  ctx->backtrackingVisits += visits;
   return true;
 }
 
 
+void TaffoInitializer::writeDeclarations(Module &m)
+{
+  std::string fn = TaffoInitializerOptions::fileNameFor(options.declarationsFile, m);
+  if (fn.empty())
+    return;
+
+  std::ofstream declarationsFile(fn, std::ios_base::trunc);
+  for (const DeclarationRecord& decl: ctx->declarations)
+    declarationsFile << decl.toString() << std::endl;
+}
+
+
+std::string DeclarationRecord::toString() const
+{
+  std::string res = target + " " + std::to_string(location) + " " +
+      std::to_string(integerPart) + " " + std::to_string(fractionalPart);
+  if (isFunction)
+    res += " function";
+  return res;
+}
+
+
 void TaffoInitializer::removeAnnotationCalls(ConvQueueT& q)
 {
   for (auto i = q.begin(); i != q.end();) {
@@ -100,21 +393,23 @@ void TaffoInitializer::setMetadataOfValue(Value *v, ValueInfo& vi)
   std::shared_ptr<mdutils::MDInfo> md = vi.metadata;
 
   if (isa<Instruction>(v) || isa<GlobalObject>(v)) {
-    mdutils::MetadataManager::setInputInfoInitWeightMetadata(v, vi.fixpTypeRootDistance);
+    mdutils::MetadataManager::setInputInfoInitWeightMetadata(v, vi.rootDistanceWeight());
   }
 
   if (Instruction *inst = dyn_cast<Instruction>(v)) {
-    if (vi.target.hasValue())
-      mdutils::MetadataManager::setTargetMetadata(*inst, vi.target.getValue());
+    if (vi.hasTarget())
+      mdutils::MetadataManager::setTargetMetadata(*inst, ctx->targetNames.lookup(vi.target));
 
     if (mdutils::InputInfo *ii = dyn_cast<mdutils::InputInfo>(md.get())) {
       mdutils::MetadataManager::setInputInfoMetadata(*inst, *ii);
+      ctx->attachedMetadata[inst].reset(ii->clone());
     } else if (mdutils::StructInfo *si = dyn_cast<mdutils::StructInfo>(md.get())) {
       mdutils::MetadataManager::setStructInfoMetadata(*inst, *si);
+      ctx->attachedMetadata[inst].reset(si->clone());
     }
   } else if (GlobalObject *con = dyn_cast<GlobalObject>(v)) {
-    if (vi.target.hasValue())
-      mdutils::MetadataManager::setTargetMetadata(*con, vi.target.getValue());
+    if (vi.hasTarget())
+      mdutils::MetadataManager::setTargetMetadata(*con, ctx->targetNames.lookup(vi.target));
 
     if (mdutils::InputInfo *ii = dyn_cast<mdutils::InputInfo>(md.get())) {
       mdutils::MetadataManager::setInputInfoMetadata(*con, *ii);
@@ -126,34 +421,36 @@ void TaffoInitializer::setMetadataOfValue(Value *v, ValueInfo& vi)
 
 
 void TaffoInitializer::setFunctionArgsMetadata(Module &m, ConvQueueT& Q)
+{
+  for (Function &f : m.functions())
+    setFunctionArgsMetadata(f, Q);
+}
+
+
+void TaffoInitializer::setFunctionArgsMetadata(Function &f, ConvQueueT& Q)
 {
   std::vector<mdutils::MDInfo *> iiPVec;
   std::vector<int> wPVec;
-  for (Function &f : m.functions()) {
-    LLVM_DEBUG(dbgs() << "Processing function " << f.getName() << "\n");
-    iiPVec.reserve(f.arg_size());
-    wPVec.reserve(f.arg_size());
-
-    for (Argument &a : f.args()) {
-      LLVM_DEBUG(dbgs() << "Processing arg " << a << "\n");
-      mdutils::MDInfo *ii = nullptr;
-      int weight = -1;
-      if (Q.count(&a)) {
-        LLVM_DEBUG(dbgs() << "Info found.\n");
-        ValueInfo &vi = Q[&a];
-        ii = vi.metadata.get();
-        weight = vi.fixpTypeRootDistance;
-      }
-      iiPVec.push_back(ii);
-      wPVec.push_back(weight);
+  LLVM_DEBUG(dbgs() << "Processing function " << f.getName() << "\n");
+  iiPVec.reserve(f.arg_size());
+  wPVec.reserve(f.arg_size());
+
+  for (Argument &a : f.args()) {
+    LLVM_DEBUG(dbgs() << "Processing arg " << a << "\n");
+    mdutils::MDInfo *ii = nullptr;
+    int weight = -1;
+    if (Q.count(&a)) {
+      LLVM_DEBUG(dbgs() << "Info found.\n");
+      ValueInfo &vi = Q[&a];
+      ii = vi.metadata.get();
+      weight = vi.rootDistanceWeight();
     }
-
-    mdutils::MetadataManager::setArgumentInputInfoMetadata(f, iiPVec);
-    mdutils::MetadataManager::setInputInfoInitWeightMetadata(&f, wPVec);
-
-    iiPVec.clear();
-    wPVec.clear();
+    iiPVec.push_back(ii);
+    wPVec.push_back(weight);
   }
+
+  mdutils::MetadataManager::setArgumentInputInfoMetadata(f, iiPVec);
+  mdutils::MetadataManager::setInputInfoInitWeightMetadata(&f, wPVec);
 }
 
 
@@ -185,6 +482,11 @@ void TaffoInitializer::buildConversionQueueForRootValues(
         LLVM_DEBUG(dbgs() << "\n");
       LLVM_DEBUG(dbgs() << "    distance = " << next->second.fixpTypeRootDistance << "\n");
 
+      if (materializer) {
+        if (GlobalValue *gv = dyn_cast<GlobalValue>(v))
+          materializer->materializeReferencing(*gv);
+      }
+
       for (auto *u: v->users()) {
         /* ignore u if it is the global annotation array */
         if (GlobalObject *ugo = dyn_cast<GlobalObject>(u)) {
@@ -196,6 +498,11 @@ void TaffoInitializer::buildConversionQueueForRootValues(
           continue;
         }
 
+        if (!isFloatCarryingUser(v, next->second, u)) {
+          LLVM_DEBUG(dbgs() << "[U] " << *u << " pruned, cannot carry a float\n");
+          continue;
+        }
+
         /* Insert u at the end of the queue.
          * If u exists already in the queue, *move* it to the end instead. */
         auto UI = queue.find(u);
@@ -211,30 +518,28 @@ void TaffoInitializer::buildConversionQueueForRootValues(
         else
           LLVM_DEBUG(dbgs() << "\n");
 
-        unsigned int vdepth = std::min(next->second.backtrackingDepthLeft, next->second.backtrackingDepthLeft - 1);
-        if (vdepth < 2 && isa<StoreInst>(u)) {
-          StoreInst *store = dyn_cast<StoreInst>(u);
-          Value *valOp = store->getValueOperand();
-          Type *valueType = valOp->getType();
-          if (isa<BitCastInst>(valOp)
-              && valueType->isPointerTy()
-              && valueType->getPointerElementType()->isFloatingPointTy()) {
-            LLVM_DEBUG(dbgs() << "MALLOC'D POINTER HACK\n");
-            vdepth = 2;
-          }
-        }
+        ValueInfo::DepthT vdepth = ValueInfo::nextBacktrackingDepth(next->second.backtrackingDepthLeft);
         if (vdepth > 0) {
-          unsigned int udepth = UI->second.backtrackingDepthLeft;
+          ValueInfo::DepthT udepth = UI->second.backtrackingDepthLeft;
           UI->second.backtrackingDepthLeft = std::max(vdepth, udepth);
         }
         createInfoOfUser(v, next->second, u, UI->second);
+        logEnqueue(ProvenanceEdge::User, v, u, UI->second);
+
+        if (StoreInst *store = dyn_cast<StoreInst>(u))
+          propagateThroughAllocation(store, v, next->second, queue);
+
+        if (MemTransferInst *mt = dyn_cast<MemTransferInst>(u)) {
+          if (mt->getRawSource() == v)
+            propagateThroughMemTransfer(mt, v, next->second, queue);
+        }
       }
       ++next;
     }
 
     for (next = queue.end(); next != queue.begin();) {
       Value *v = (--next)->first;
-      unsigned int mydepth = next->second.backtrackingDepthLeft;
+      ValueInfo::DepthT mydepth = next->second.backtrackingDepthLeft;
       if (mydepth == 0)
         continue;
 
@@ -246,6 +551,11 @@ void TaffoInitializer::buildConversionQueueForRootValues(
       dbgs() << "BACKTRACK " << *v << ", depth left = " << mydepth << "\n";
       #endif
 
+      if (!chargeBacktracking(next->second.root, inst)) {
+        next->second.backtrackingDepthLeft = 0;
+        continue;
+      }
+
       for (Value *u: inst->operands()) {
         if (!isa<User>(u) && !isa<Argument>(u)) {
           #ifdef LOG_BACKTRACK
@@ -269,7 +579,7 @@ void TaffoInitializer::buildConversionQueueForRootValues(
         dbgs() << " - " << *u;
         #endif
 
-        if (!isFloatType(u->getType())) {
+        if (!getTypeSummary(u->getType()).isFloat) {
           #ifdef LOG_BACKTRACK
           dbgs() << " not a float\n";
           #endif
@@ -278,7 +588,7 @@ void TaffoInitializer::buildConversionQueueForRootValues(
 
         bool alreadyIn = false;
         ValueInfo VIU;
-        VIU.backtrackingDepthLeft = std::min(mydepth, mydepth - 1);
+        VIU.backtrackingDepthLeft = ValueInfo::nextBacktrackingDepth(mydepth);
         auto UI = queue.find(u);
         if (UI != queue.end()) {
           if (UI < next)
@@ -299,6 +609,8 @@ void TaffoInitializer::buildConversionQueueForRootValues(
         }
         
         createInfoOfUser(v, next->second, u, UI->second);
+        if (!alreadyIn)
+          logEnqueue(ProvenanceEdge::Backtracking, v, u, UI->second);
       }
     }
   }
@@ -311,14 +623,14 @@ void TaffoInitializer::createInfoOfUser(Value *used, const ValueInfo& vinfo, Val
 {
   /* Copy metadata from the closest instruction to a root */
   LLVM_DEBUG(dbgs() << "root distances: " << uinfo.fixpTypeRootDistance << " > " << vinfo.fixpTypeRootDistance << " + 1\n");
-  if (!(uinfo.fixpTypeRootDistance <= std::max(vinfo.fixpTypeRootDistance, vinfo.fixpTypeRootDistance+1))) {
+  if (!(uinfo.fixpTypeRootDistance <= ValueInfo::nextRootDistance(vinfo.fixpTypeRootDistance))) {
     /* Do not copy metadata in case of type conversions from struct to
      * non-struct and vice-versa.
      * We could check the instruction type and copy the correct type
      * contained in the struct type or create a struct type with the
      * correct type in the correct place, but is'a huge mess */
-    Type *usedt = fullyUnwrapPointerOrArrayType(used->getType());
-    Type *usert = fullyUnwrapPointerOrArrayType(user->getType());
+    Type *usedt = getTypeSummary(used->getType()).unwrapped;
+    Type *usert = getTypeSummary(user->getType()).unwrapped;
     bool copyok = (usedt == usert);
     copyok |= (!usedt->isStructTy() && !usert->isStructTy()) || isa<StoreInst>(user);
     if (isa<GetElementPtrInst>(user) && used != dyn_cast<GetElementPtrInst>(user)->getPointerOperand())
@@ -335,7 +647,8 @@ void TaffoInitializer::createInfoOfUser(Value *used, const ValueInfo& vinfo, Val
     }
 
     uinfo.target = vinfo.target;
-    uinfo.fixpTypeRootDistance = std::max(vinfo.fixpTypeRootDistance, vinfo.fixpTypeRootDistance+1);
+    uinfo.root = vinfo.root;
+    uinfo.fixpTypeRootDistance = ValueInfo::nextRootDistance(vinfo.fixpTypeRootDistance);
     LLVM_DEBUG(dbgs() << "[" << *user << "] update fixpTypeRootDistance=" << uinfo.fixpTypeRootDistance << "\n");
   } else {
     LLVM_DEBUG(dbgs() << "[" << *user << "] not updated fixpTypeRootDistance=" << uinfo.fixpTypeRootDistance << "\n");
@@ -356,6 +669,132 @@ void TaffoInitializer::createInfoOfUser(Value *used, const ValueInfo& vinfo, Val
   }
 }
 
+/* memcpy and memmove copy the contents of the source buffer into the
+ * destination, which therefore gets the metadata of the source. The
+ * intrinsics are not users of the destination buffer in the direction of
+ * the copy, so the destination is enqueued explicitly. memset writes a
+ * constant pattern and is a sink: nothing flows out of it. */
+void TaffoInitializer::propagateThroughMemTransfer(MemTransferInst *mt, Value *used, const ValueInfo& vinfo, ConvQueueT& queue)
+{
+  /* The i8* operand of the intrinsic has lost the type of the buffer, take
+   * the metadata from the copied object itself when it is in the queue */
+  Value *src = mt->getSource();
+  const ValueInfo *srcInfo = &vinfo;
+  auto SI = queue.find(src);
+  if (SI != queue.end() && SI->second.metadata)
+    srcInfo = &SI->second;
+  else
+    src = used;
+  if (!srcInfo->metadata)
+    return;
+
+  Value *dst = mt->getDest();
+  if (dst == src || dst == used || (isa<Constant>(dst) && !isa<GlobalVariable>(dst)))
+    return;
+  enqueueDerivedValue(src, *srcInfo, dst, queue, ProvenanceEdge::MemTransfer);
+}
+
+
+/* Heap buffers are tracked from their allocation site. The pointer
+ * returned by an allocation function reaches the float data only through
+ * casts and through the pointer slot it is stored into:
+ *  - when the slot is in the queue, the casts and the allocation call get
+ *    the metadata of the slot;
+ *  - when the pointer is in the queue, the slot gets its metadata and the
+ *    loads from the slot are propagated as usual. */
+void TaffoInitializer::propagateThroughAllocation(StoreInst *store, Value *used, const ValueInfo& vinfo, ConvQueueT& queue)
+{
+  if (!vinfo.metadata)
+    return;
+  Value *stored = store->getValueOperand();
+  if (!stored->getType()->isPointerTy())
+    return;
+
+  SmallVector<Value *, 4> casts;
+  CallSite alloc = getAllocationSite(stored, &casts);
+  if (!alloc)
+    return;
+
+  if (used == store->getPointerOperand()) {
+    LLVM_DEBUG(dbgs() << "[A] allocation site " << *alloc.getInstruction() << " stored into " << *used << "\n");
+    Value *prev = used;
+    for (Value *c: casts) {
+      enqueueDerivedValue(prev, queue[prev], c, queue, ProvenanceEdge::Allocation);
+      prev = c;
+    }
+    enqueueDerivedValue(prev, queue[prev], alloc.getInstruction(), queue, ProvenanceEdge::Allocation);
+  } else if (used == stored) {
+    Value *slot = store->getPointerOperand()->stripPointerCasts();
+    if (isa<Constant>(slot) && !isa<GlobalVariable>(slot))
+      return;
+    LLVM_DEBUG(dbgs() << "[A] allocation site " << *alloc.getInstruction() << " stored into " << *slot << "\n");
+    enqueueDerivedValue(used, vinfo, slot, queue, ProvenanceEdge::Allocation);
+  }
+}
+
+
+/* Returns the call to an allocation function which produced ptr, if any,
+ * looking through pointer casts. The casts are collected from ptr to the
+ * call, excluded. */
+CallSite TaffoInitializer::getAllocationSite(Value *ptr, SmallVectorImpl<Value *> *casts)
+{
+  while (Operator::getOpcode(ptr) == Instruction::BitCast
+      || Operator::getOpcode(ptr) == Instruction::AddrSpaceCast) {
+    if (casts && isa<Instruction>(ptr))
+      casts->push_back(ptr);
+    ptr = cast<User>(ptr)->getOperand(0);
+  }
+  if (!isa<CallInst>(ptr) && !isa<InvokeInst>(ptr))
+    return CallSite();
+  CallSite call(ptr);
+  Function *f = call.getCalledFunction();
+  if (!f)
+    return CallSite();
+
+  StringRef name = f->getName();
+  bool isAlloc = name == "malloc" || name == "calloc" || name == "realloc"
+      || name == "aligned_alloc" || name == "memalign" || name == "valloc"
+      /* operator new and new[], in all their overloads */
+      || name.startswith("_Znw") || name.startswith("_Zna")
+      || ctx->allocationFunctions.count(name);
+  return isAlloc ? call : CallSite();
+}
+
+
+/* Enqueue dst at the end of the queue as a value derived from src, taking
+ * the metadata of src unless dst is already closer to a root. */
+ValueInfo& TaffoInitializer::enqueueDerivedValue(Value *src, const ValueInfo& srcInfo, Value *dst, ConvQueueT& queue, ProvenanceEdge kind)
+{
+  auto DI = queue.find(dst);
+  ValueInfo DVInfo;
+  if (DI != queue.end()) {
+    DVInfo = DI->second;
+    queue.erase(DI);
+  }
+  ValueInfo& dinfo = queue.push_back(dst, std::move(DVInfo)).first->second;
+  LLVM_DEBUG(dbgs() << "[D] " << *dst << " derived from " << *src << "\n");
+
+  if (dinfo.fixpTypeRootDistance > ValueInfo::nextRootDistance(srcInfo.fixpTypeRootDistance)) {
+    /* A StructInfo is copied whole into a buffer of the same type, which
+     * keeps the metadata of each field */
+    Type *srct = getTypeSummary(src->getType()).unwrapped;
+    Type *dstt = getTypeSummary(dst->getType()).unwrapped;
+    if (srct == dstt || (!srct->isStructTy() && !dstt->isStructTy())) {
+      dinfo.metadata.reset(srcInfo.metadata->clone());
+    } else {
+      dinfo.metadata = mdutils::StructInfo::constructFromLLVMType(dstt);
+      if (dinfo.metadata.get() == nullptr)
+        dinfo.metadata.reset(new mdutils::InputInfo(nullptr, nullptr, nullptr, true));
+    }
+    dinfo.target = srcInfo.target;
+    dinfo.root = srcInfo.root;
+    dinfo.fixpTypeRootDistance = ValueInfo::nextRootDistance(srcInfo.fixpTypeRootDistance);
+  }
+  logEnqueue(kind, src, dst, dinfo);
+  return dinfo;
+}
+
+
 std::shared_ptr<mdutils::MDInfo>
 TaffoInitializer::extractGEPIMetadata(const llvm::Value *user,
 				      const llvm::Value *used,
@@ -392,6 +831,11 @@ TaffoInitializer::extractGEPIMetadata(const llvm::Value *user,
       cast<StructType>(source_element_type)->getTypeAtIndex(n);
     } else {
       LLVM_DEBUG(dbgs() << "[extractGEPIMetadata] fail, non-const index encountered\n");
+      getRemarkEmitter(gepi->getFunction()).emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "GEPMetadata", gepi)
+            << "cannot extract the metadata of the field addressed by a non-constant index into "
+            << ore::NV("Type", source_element_type);
+      });
       return nullptr;
     }
   }
@@ -410,86 +854,184 @@ void TaffoInitializer::generateFunctionSpace(ConvQueueT& vals,
 {
   LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
   
-  for (auto VVI: vals) {
+  for (auto VVI = vals.begin(); VVI != vals.end(); ++VVI) {
     Value *v = VVI->first;
     if (!(isa<CallInst>(v) || isa<InvokeInst>(v)))
       continue;
     CallSite *call = new CallSite(v);
     
+    Instruction *callInst = call->getInstruction();
+    OptimizationRemarkEmitter& ORE = getRemarkEmitter(callInst->getFunction());
+    
     Function *oldF = call->getCalledFunction();
     if (!oldF) {
+      /* The guarded direct calls are appended to the queue and specialized
+       * when the loop reaches them */
+      if (devirtualizeCall(call, vals))
+        continue;
       LLVM_DEBUG(dbgs() << "found bitcasted funcptr in " << *v << ", skipping\n");
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "IndirectCall", callInst)
+            << "not specialized: indirect call through "
+            << ore::NV("Callee", call->getCalledValue()->stripPointerCasts());
+      });
       continue;
     }
-    if(isSpecialFunction(oldF))
+
+    /* Runtime entry points (OpenMP fork calls, thread creation) are not
+     * specialized themselves: the function they call back is, with the
+     * values they forward to it */
+    SmallVector<Value *, 8> actuals;
+    int callbackOperand = getCallbackArguments(call, actuals);
+    if (callbackOperand >= 0)
+      oldF = cast<Function>(call->getArgument(callbackOperand)->stripPointerCasts());
+    else
+      actuals.assign(call->arg_begin(), call->arg_end());
+
+    if (materializer)
+      materializer->materialize(*oldF);
+    if (callbackOperand < 0 && oldF->isDeclaration() && !oldF->isIntrinsic() &&
+        specializeAcrossModules(call, oldF, actuals, vals))
+      continue;
+    if(isSpecialFunction(oldF)) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "SpecialFunction", callInst)
+            << "not specialized: " << ore::NV("Callee", oldF)
+            << (oldF->isIntrinsic() ? " is an intrinsic" : " has no body");
+      });
       continue;
-    if (ManualFunctionCloning) {
-      if (enabledFunctions.count(oldF) == 0) {
+    }
+    if (options.manualFunctionCloning) {
+      if (ctx->enabledFunctions.count(oldF) == 0) {
         LLVM_DEBUG(dbgs() << "skipped cloning of function from call " << *v << ": function disabled\n");
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "CloningDisabled", callInst)
+              << "not specialized: " << ore::NV("Callee", oldF)
+              << " is not annotated and -manualclone is set";
+        });
         continue;
       }
     }
 
     std::vector<llvm::Value*> newVals;
+    /* In streaming mode the clone gets a queue of its own, processed and
+     * released after the current function */
+    std::unique_ptr<ConvQueueT> streamVals;
+    if (options.streaming)
+      streamVals.reset(new ConvQueueT());
+    ConvQueueT& cloneVals = streamVals ? *streamVals : vals;
     
-    Function *newF = createFunctionAndQueue(call, vals, global, newVals);
-    call->setCalledFunction(newF);
-    enabledFunctions.insert(newF);
+    Function *newF = createFunctionAndQueue(call, oldF, actuals, vals, cloneVals, global, newVals);
+    if (callbackOperand >= 0) {
+      Value *oldCallback = call->getArgument(callbackOperand);
+      call->setArgument(callbackOperand, ConstantExpr::getBitCast(newF, oldCallback->getType()));
+    } else {
+      call->setCalledFunction(newF);
+    }
+    ctx->enabledFunctions.insert(newF);
+    ORE.emit([&]() {
+      return OptimizationRemark(DEBUG_TYPE, "FunctionCloned", callInst)
+          << "specialized " << ore::NV("Callee", oldF) << " into " << ore::NV("Clone", newF)
+          << " for argument signature (" << ore::NV("Signature", getArgumentSignature(actuals, vals))
+          << "), " << ore::NV("CloneSize", newF->getInstructionCount()) << " instructions";
+    });
 
     //Attach metadata
-    MDNode *newFRef = MDNode::get(call->getInstruction()->getContext(),ValueAsMetadata::get(newF));
     MDNode *oldFRef = MDNode::get(call->getInstruction()->getContext(),ValueAsMetadata::get(oldF));
 
-    call->getInstruction()->setMetadata(ORIGINAL_FUN_METADATA, oldFRef);
-    if (MDNode *cloned = oldF->getMetadata(CLONED_FUN_METADATA)) {
-      cloned = cloned->concatenate(cloned, newFRef);
-      oldF->setMetadata(CLONED_FUN_METADATA, cloned);
-    } else {
-      oldF->setMetadata(CLONED_FUN_METADATA, newFRef);
-    }
-    newF->setMetadata(CLONED_FUN_METADATA, NULL);
-    newF->setMetadata(SOURCE_FUN_METADATA, oldFRef);
+    if (callbackOperand < 0)
+      call->getInstruction()->setMetadata(ORIGINAL_FUN_METADATA, oldFRef);
+    linkClone(oldF, newF);
 
-    mdutils::MetadataManager& mm = mdutils::MetadataManager::getMetadataManager();
     for (auto v: newVals) {
       Instruction *i = dyn_cast<Instruction>(v);
-      if (!i || !mm.retrieveInputInfo(*i))
-        setMetadataOfValue(v, vals[v]);
+      std::shared_ptr<mdutils::MDInfo> attached = i ? ctx->attachedMetadata.lookup(i) : nullptr;
+      if (!attached || !isa<mdutils::InputInfo>(attached.get()))
+        setMetadataOfValue(v, cloneVals[v]);
     }
 
     /* Reconstruct the value info for the values which are in the top-level
      * conversion queue and in the oldF
      * Allows us to properly process call functions */
-    // TODO: REWRITE USING THE VALUE MAP RETURNED BY CloneFunctionInto
     for (BasicBlock& bb: *newF) {
       for (Instruction& i: bb) {
-        if (mdutils::MDInfo *mdi = mm.retrieveMDInfo(&i)) {
-          ValueInfo& vi = vals.insert(vals.end(), &i, ValueInfo()).first->second;
+        if (std::shared_ptr<mdutils::MDInfo> mdi = ctx->attachedMetadata.lookup(&i)) {
+          ValueInfo& vi = cloneVals.insert(cloneVals.end(), &i, ValueInfo()).first->second;
           vi.metadata.reset(mdi->clone());
-          int weight = mm.retrieveInputInfoInitWeightMetadata(&i);
+          int weight = mdutils::MetadataManager::retrieveInputInfoInitWeightMetadata(&i);
           if (weight >= 0)
-            vi.fixpTypeRootDistance = weight;
-          vals.push_back(&i, vi);
+            vi.fixpTypeRootDistance = ValueInfo::clampDepth(weight);
+          cloneVals.push_back(&i, vi);
           LLVM_DEBUG(dbgs() << "  enqueued & rebuilt valueInfo of " << i << " in " << newF->getName() << "\n");
         }
       }
     }
+    if (streamVals)
+      ctx->pendingQueues.push_back(std::make_pair(newF, std::move(streamVals)));
   }
   
   LLVM_DEBUG(dbgs() << "***** end " << __PRETTY_FUNCTION__ << "\n");
 }
 
 
-Function* TaffoInitializer::createFunctionAndQueue(llvm::CallSite *call, ConvQueueT& vals, ConvQueueT& global, std::vector<llvm::Value*> &convQueue)
+/* Record newF in the chain of the clones of oldF */
+void TaffoInitializer::linkClone(Function *oldF, Function *newF)
+{
+  MDNode *newFRef = MDNode::get(oldF->getContext(), ValueAsMetadata::get(newF));
+  MDNode *oldFRef = MDNode::get(oldF->getContext(), ValueAsMetadata::get(oldF));
+  if (MDNode *cloned = oldF->getMetadata(CLONED_FUN_METADATA)) {
+    cloned = cloned->concatenate(cloned, newFRef);
+    oldF->setMetadata(CLONED_FUN_METADATA, cloned);
+  } else {
+    oldF->setMetadata(CLONED_FUN_METADATA, newFRef);
+  }
+  newF->setMetadata(CLONED_FUN_METADATA, NULL);
+  newF->setMetadata(SOURCE_FUN_METADATA, oldFRef);
+}
+
+
+std::string TaffoInitializer::getArgumentSignature(ArrayRef<Value *> args, ConvQueueT& vals)
+{
+  std::string res;
+  for (unsigned i = 0; i < args.size(); i++) {
+    if (i > 0)
+      res += ", ";
+    auto vi = args[i] ? vals.find(args[i]) : vals.end();
+    if (vi != vals.end() && vi->second.metadata)
+      res += vi->second.metadata->toString();
+    else
+      res += "-";
+  }
+  return res;
+}
+
+
+Function* TaffoInitializer::createFunctionAndQueue(llvm::CallSite *call, Function *oldF, ArrayRef<Value *> actuals, ConvQueueT& vals, ConvQueueT& cloneVals, ConvQueueT& global, std::vector<llvm::Value*> &convQueue)
+{
+  LLVM_DEBUG(dbgs() << "  callsite instr " << *call->getInstruction() << " [" << call->getInstruction()->getFunction()->getName() << "]\n");
+  SmallVector<const ValueInfo *, 8> argInfos;
+  for (Value *callOperand: actuals) {
+    if (!callOperand || !vals.count(callOperand))
+      argInfos.push_back(nullptr);
+    else
+      argInfos.push_back(&vals[callOperand]);
+  }
+  return cloneFunctionAndQueue(oldF, actuals, argInfos, cloneVals, global, convQueue);
+}
+
+
+Function* TaffoInitializer::cloneFunctionAndQueue(Function *oldF, ArrayRef<Value *> actuals, ArrayRef<const ValueInfo *> argInfos, ConvQueueT& vals, ConvQueueT& global, std::vector<llvm::Value*> &convQueue)
 {
   LLVM_DEBUG(dbgs() << "***** begin " << __PRETTY_FUNCTION__ << "\n");
 
   
   /* vals: conversion queue of caller
    * global: global values to copy in all converison queues
+   * actuals: value passed to each argument of oldF by the call, or null;
+   *   empty when the clone is not created for a call
+   * argInfos: value info of each argument of oldF, or null
    * convQueue: output conversion queue of this function */
   
-  Function *oldF = call->getCalledFunction();
   Function *newF = Function::Create(
       oldF->getFunctionType(), oldF->getLinkage(),
       oldF->getName(), oldF->getParent());
@@ -503,31 +1045,41 @@ Function* TaffoInitializer::createFunctionAndQueue(llvm::CallSite *call, ConvQue
   }
   SmallVector<ReturnInst*,100> returns;
   CloneFunctionInto(newF, oldF, mapArgs, true, returns);
+  /* The clone carries the metadata of oldF */
+  for (Instruction& oldI: instructions(oldF)) {
+    auto attached = ctx->attachedMetadata.find(&oldI);
+    if (attached == ctx->attachedMetadata.end())
+      continue;
+    if (Instruction *newI = dyn_cast_or_null<Instruction>(mapArgs.lookup(&oldI)))
+      ctx->attachedMetadata[newI] = attached->second;
+  }
   newF->setLinkage(GlobalVariable::LinkageTypes::InternalLinkage);
   FunctionCloned++;
+  ctx->functionCloned++;
 
   ConvQueueT roots;
   oldArgumentI = oldF->arg_begin();
   newArgumentI = newF->arg_begin();
   LLVM_DEBUG(dbgs() << "Create function from " << oldF->getName() << " to " << newF->getName() << "\n");
-  LLVM_DEBUG(dbgs() << "  callsite instr " << *call->getInstruction() << " [" << call->getInstruction()->getFunction()->getName() << "]\n");
   for (int i=0; oldArgumentI != oldF->arg_end() ; oldArgumentI++, newArgumentI++, i++) {
-    Value *callOperand = call->getInstruction()->getOperand(i);
-    Value *allocaOfArgument = newArgumentI->user_begin()->getOperand(1);
-    if (!isa<AllocaInst>(allocaOfArgument))
-      allocaOfArgument = nullptr;
+    Value *callOperand = actuals.empty() ? nullptr : actuals[i];
+    Value *allocaOfArgument = nullptr;
+    if (!newArgumentI->user_empty() && newArgumentI->user_begin()->getNumOperands() > 1)
+      allocaOfArgument = dyn_cast<AllocaInst>(newArgumentI->user_begin()->getOperand(1));
     
-    if (!vals.count(callOperand)) {
+    if (!argInfos[i]) {
       LLVM_DEBUG(dbgs() << "  Arg nr. " << i << " skipped, callOperand has no valueInfo\n");
       continue;
     }
   
-    ValueInfo& callVi = vals[callOperand];
+    const ValueInfo& callVi = *argInfos[i];
     
     ValueInfo& argumentVi = vals.insert(vals.end(), newArgumentI, ValueInfo()).first->second;
     // Mark the argument itself (set it as a new root as well in VRA-less mode)
     argumentVi.metadata.reset(callVi.metadata->clone());
-    argumentVi.fixpTypeRootDistance = std::max(callVi.fixpTypeRootDistance, callVi.fixpTypeRootDistance+1);
+    argumentVi.fixpTypeRootDistance = ValueInfo::nextRootDistance(callVi.fixpTypeRootDistance);
+    argumentVi.root = callVi.root;
+    logEnqueue(ProvenanceEdge::ClonedArgument, callOperand, newArgumentI, argumentVi);
     if (!allocaOfArgument) {
       roots.push_back(newArgumentI, argumentVi);
     }
@@ -537,7 +1089,9 @@ Function* TaffoInitializer::createFunctionAndQueue(llvm::CallSite *call, ConvQue
       // Mark the alloca used for the argument (in O0 opt lvl)
       // let it be a root in VRA-less mode
       allocaVi.metadata.reset(callVi.metadata->clone());
-      allocaVi.fixpTypeRootDistance = std::max(callVi.fixpTypeRootDistance, callVi.fixpTypeRootDistance+2);
+      allocaVi.fixpTypeRootDistance = ValueInfo::nextRootDistance(callVi.fixpTypeRootDistance, 2);
+      allocaVi.root = callVi.root;
+      logEnqueue(ProvenanceEdge::ClonedAlloca, callOperand, allocaOfArgument, allocaVi);
       roots.push_back(allocaOfArgument, allocaVi);
     }
     
@@ -553,11 +1107,11 @@ Function* TaffoInitializer::createFunctionAndQueue(llvm::CallSite *call, ConvQue
   readLocalAnnotations(*newF, localFix);
   roots.insert(roots.begin(), localFix.begin(), localFix.end());
   buildConversionQueueForRootValues(roots, tmpVals);
-  for (auto val: tmpVals){
-    if (Instruction *inst = dyn_cast<Instruction>(val.first)) {
+  for (auto val = tmpVals.begin(); val != tmpVals.end(); ++val) {
+    if (Instruction *inst = dyn_cast<Instruction>(val->first)) {
       if (inst->getFunction()==newF){
-        vals.push_back(val);
-        convQueue.push_back(val.first);
+        vals.push_back(val->first, val->second);
+        convQueue.push_back(val->first);
         LLVM_DEBUG(dbgs() << "  enqueued " << *inst << " in " << newF->getName() << "\n");
       }
     }
@@ -568,13 +1122,57 @@ Function* TaffoInitializer::createFunctionAndQueue(llvm::CallSite *call, ConvQue
 }
 
 
+/* Runtime entry points which call the function passed as one of their
+ * arguments, forwarding some of the others to it. Returns the index of the
+ * callback argument and fills actuals with the value received by each
+ * parameter of the callback (null when not forwarded), or returns -1. */
+int TaffoInitializer::getCallbackArguments(CallSite *call, SmallVectorImpl<Value *>& actuals)
+{
+  Function *rt = call->getCalledFunction();
+  if (!rt)
+    return -1;
+
+  StringRef name = rt->getName();
+  unsigned callbackOp, firstForwarded, firstParam;
+  if (name == "__kmpc_fork_call" || name == "__kmpc_fork_teams") {
+    /* (loc, argc, microtask, captured...) -> microtask(gtid*, btid*, captured...) */
+    callbackOp = 2;
+    firstForwarded = 3;
+    firstParam = 2;
+  } else if (name == "pthread_create") {
+    /* (thread, attr, start, arg) -> start(arg) */
+    callbackOp = 2;
+    firstForwarded = 3;
+    firstParam = 0;
+  } else if (name == "GOMP_parallel" || name == "GOMP_parallel_start") {
+    /* (fn, data, ...) -> fn(data) */
+    callbackOp = 0;
+    firstForwarded = 1;
+    firstParam = 0;
+  } else {
+    return -1;
+  }
+  if (call->getNumArgOperands() <= callbackOp)
+    return -1;
+  Function *callback = dyn_cast<Function>(call->getArgument(callbackOp)->stripPointerCasts());
+  if (!callback)
+    return -1;
+
+  actuals.assign(callback->arg_size(), nullptr);
+  for (unsigned a = firstForwarded, p = firstParam;
+       a < call->getNumArgOperands() && p < callback->arg_size(); a++, p++)
+    actuals[p] = call->getArgument(a);
+  return callbackOp;
+}
+
+
 void TaffoInitializer::printConversionQueue(ConvQueueT& vals)
 {
   if (vals.size() < 1000) {
     dbgs() << "conversion queue:\n";
-    for (auto val: vals) {
-      dbgs() << "bt=" << val.second.backtrackingDepthLeft << " ";
-      dbgs() << "md=" << val.second.metadata->toString() << " ";
+    for (auto val = vals.begin(); val != vals.end(); ++val) {
+      dbgs() << "bt=" << val->second.backtrackingDepthLeft << " ";
+      dbgs() << "md=" << val->second.metadata->toString() << " ";
     }
     dbgs() << "\n\n";
   } else {
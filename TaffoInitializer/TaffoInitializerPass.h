@@ -1,18 +1,29 @@
+#include <climits>
 #include <limits>
+#include <memory>
+#include <string>
+#include <vector>
 #include "llvm/IR/CallSite.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Pass.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/IR/ValueMap.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "MultiValueMap.h"
 #include "InputInfo.h"
+#include "ProvenanceLog.h"
 
 
 #ifndef __TAFFO_INITIALIZER_PASS_H__
@@ -27,14 +38,312 @@ STATISTIC(AnnotationCount, "Number of valid annotations found");
 STATISTIC(FunctionCloned, "Number of fixed point function inserted");
 
 
+namespace llvm {
+class PassBuilder;
+}
+
+
 namespace taffo {
 
+class LazyFunctionMaterializer;
+class AnnotationDatabase;
+
+/* Per-module table of the error propagation target names.
+ * Values refer to their target by index, so that each name is stored only
+ * once no matter how many values it is propagated to. */
+class TargetNameTable {
+public:
+  using ID = uint32_t;
+  static constexpr ID None = 0;
+
+  ID intern(llvm::StringRef name) {
+    auto ins = index.insert(std::make_pair(name, None));
+    if (ins.second) {
+      names.push_back(ins.first->getKey());
+      ins.first->second = names.size();
+    }
+    return ins.first->second;
+  }
+  llvm::StringRef lookup(ID id) const {
+    assert(id != None && id <= names.size() && "invalid target id");
+    return names[id - 1];
+  }
+  void clear() {
+    names.clear();
+    index.clear();
+  }
+
+private:
+  llvm::StringMap<ID> index;
+  std::vector<llvm::StringRef> names;
+};
+
+
 struct ValueInfo {
-  unsigned int backtrackingDepthLeft = 0;
-  unsigned int fixpTypeRootDistance = UINT_MAX;
+  using DepthT = uint16_t;
+  static constexpr DepthT UnboundedBacktracking = UINT16_MAX;
+  static constexpr DepthT UnknownRootDistance = UINT16_MAX;
+  /* Identifies the annotation the metadata descends from */
+  using RootID = uint32_t;
+  static constexpr RootID NoRoot = 0;
 
   std::shared_ptr<mdutils::MDInfo> metadata;
+  TargetNameTable::ID target = TargetNameTable::None;
+  DepthT backtrackingDepthLeft = 0;
+  DepthT fixpTypeRootDistance = UnknownRootDistance;
+  RootID root = NoRoot;
+
+  bool hasTarget() const { return target != TargetNameTable::None; }
+
+  /* Both counters saturate: an unbounded backtracking depth stays unbounded,
+   * and an unknown root distance stays unknown. Only UINT_MAX, the depth of
+   * backtracking(true), is unbounded: larger finite depths are clamped to
+   * the largest finite one. */
+  static DepthT clampDepth(unsigned int depth) {
+    if (depth == UINT_MAX)
+      return UnboundedBacktracking;
+    return std::min<unsigned int>(depth, UnboundedBacktracking - 1);
+  }
+  static DepthT nextBacktrackingDepth(DepthT depth) {
+    if (depth == UnboundedBacktracking || depth == 0)
+      return depth;
+    return depth - 1;
+  }
+  static DepthT nextRootDistance(DepthT dist, DepthT step = 1) {
+    if (dist >= UnknownRootDistance - step)
+      return UnknownRootDistance;
+    return dist + step;
+  }
+  /* Weight as stored in the metadata, where -1 means "no distance" */
+  int rootDistanceWeight() const {
+    return fixpTypeRootDistance == UnknownRootDistance ? -1 : fixpTypeRootDistance;
+  }
+};
+
+
+/* Scalar type reached by stripping pointers, arrays and vectors; each lane
+ * of a vector of floats gets the metadata of the vector itself */
+inline llvm::Type *fullyUnwrapPointerArrayOrVectorType(llvm::Type *ty) {
+  while (ty->isArrayTy() || ty->isPointerTy() || ty->isVectorTy()) {
+    if (ty->isPointerTy())
+      ty = ty->getPointerElementType();
+    else if (ty->isArrayTy())
+      ty = ty->getArrayElementType();
+    else
+      ty = llvm::cast<llvm::VectorType>(ty)->getElementType();
+  }
+  return ty;
+}
+
+
+/* Properties of a type queried by the propagation for every edge */
+struct TypeSummary {
+  llvm::Type *unwrapped;
+  bool isFloat;
+};
+
+
+/* Options of the initializer. They are snapshotted once per pass instance,
+ * so that a run never reads the global cl::opt storage and the runs in the
+ * same process can be given different options. */
+struct TaffoInitializerOptions {
+  int fracThreshold = 3;
+  int totalBits = 32;
+  bool manualFunctionCloning = false;
+  /* Maximum number of operands visited while backtracking, per annotation
+   * root and for the whole module; 0 means unlimited */
+  uint64_t backtrackingRootBudget = 50000;
+  uint64_t backtrackingModuleBudget = 1000000;
+  /* Only estimate the cost of the conversion, without modifying the IR */
+  bool estimateOnly = false;
+  /* Output file names. "%m" is replaced with the name of the module; an
+   * empty name disables the output. */
+  std::string declarationsFile = "declarations";
+  std::string provenanceFile;
+  std::string estimateFile = "-";
+  /* Range profiling: instrument the module to record the ranges of the
+   * annotated values at run time, or narrow the annotated ranges using a
+   * recorded profile */
+  bool profileGenerate = false;
+  std::string profileRuntimeFile = "taffo-ranges.prof";
+  std::string profileUseFile;
+  double profileMargin = 0.1;
+  /* Narrow the propagated ranges from constant operands and initializers */
+  bool tightenRanges = false;
+  /* Give a common format to the values used together in a loop nest */
+  bool unifyLoopFormats = false;
+  unsigned loopFormatMaxFracLoss = 8;
+  /* Maximum number of guarded direct calls an indirect call with annotated
+   * arguments is rewritten into; 0 disables the devirtualization */
+  unsigned devirtualizationTargets = 4;
+  /* Functions returning a fresh heap buffer besides the standard ones */
+  std::vector<std::string> allocationFunctions;
+  /* Precompiled annotation database applied besides the source annotations */
+  std::string annotationDatabaseFile;
+  /* Definitions of the annotation profiles */
+  std::string annotationProfilesFile;
+  /* Cross-module specialization: summary of the calls to functions of
+   * other modules, and specializations decided by taffo-init-thinlink */
+  std::string summaryFile;
+  std::string thinLinkDecisionsFile;
+  /* Merge the identical clones and remove the unused specialized functions */
+  bool cleanupClones = true;
+  /* Give each clone a conversion queue of its own, released once processed,
+   * instead of appending it to the queue of the module. The propagation
+   * from the annotations still builds the queue of the whole module. */
+  bool streaming = false;
+
+  static TaffoInitializerOptions fromCommandLine();
+  static std::string fileNameFor(const std::string &pattern, const llvm::Module &m);
+};
+
+
+/* Result of the parsing of an annotation, also stored in the annotation
+ * database */
+struct ParsedAnnotation {
   llvm::Optional<std::string> target;
+  bool startingPoint = false;
+  bool backtracking = false;
+  unsigned int backtrackingDepth = 0;
+  std::shared_ptr<mdutils::MDInfo> metadata;
+};
+
+/* Deep copy of the metadata of an annotation, for values which may modify
+ * it in place */
+std::shared_ptr<mdutils::MDInfo> copyAnnotationMetadata(const mdutils::MDInfo *md);
+
+
+/* Named annotations, referenced with profile('name') in other annotations.
+ * Profiles are defined in a file (-taffo-init-annotation-profiles) or by
+ * define_profile('name') annotations of global variables, functions or
+ * local variables anywhere in the module. */
+class AnnotationProfileTable {
+public:
+  void insert(llvm::StringRef name, const ParsedAnnotation& profile) { profiles[name] = profile; }
+  bool define(llvm::StringRef name, llvm::StringRef annotation, std::string& err);
+  /* One "<name> <annotation>" definition per line, # starts a comment */
+  bool readFile(llvm::StringRef filename, std::string& err);
+  const ParsedAnnotation *lookup(llvm::StringRef name) const {
+    auto found = profiles.find(name);
+    return found == profiles.end() ? nullptr : &found->second;
+  }
+  bool empty() const { return profiles.empty(); }
+
+private:
+  llvm::StringMap<ParsedAnnotation> profiles;
+};
+
+
+struct DeclarationRecord {
+  llvm::Value *value;
+  std::string target;
+  int location;
+  int integerPart;
+  unsigned fractionalPart;
+  bool isFunction;
+
+  /* Line of the declarations file */
+  std::string toString() const;
+};
+
+
+/* Cost of the clones spawned by a call, including the nested ones */
+struct CloneCost {
+  size_t queueSize = 0;
+  size_t clones = 0;
+  size_t instructions = 0;
+};
+
+
+/* Figures predicted by the estimation mode */
+struct ConversionEstimate {
+  size_t rootQueueSize = 0;
+  CloneCost cloning;
+  llvm::StringMap<CloneCost> signatures;
+  llvm::StringSet<> inProgress;
+  llvm::DenseMap<ValueInfo::RootID, size_t> rootValues;
+};
+
+
+/* All the state of a single invocation of the initializer on a module.
+ * It is kept alive until the next run so that embedders (e.g. the taffo-init
+ * driver) can collect the results after runOnModule returns. */
+struct InitializerContext {
+  llvm::Module &module;
+  const TaffoInitializerOptions &options;
+
+  llvm::SmallPtrSet<llvm::Function *, 32> enabledFunctions;
+  TargetNameTable targetNames;
+  std::vector<DeclarationRecord> declarations;
+
+  unsigned annotationCount = 0;
+  unsigned functionCloned = 0;
+  unsigned callsDevirtualized = 0;
+  unsigned clonesMerged = 0;
+  unsigned functionsRemoved = 0;
+  size_t conversionQueueSize = 0;
+  /* Streaming mode: largest number of queue entries alive at once */
+  size_t peakQueueSize = 0;
+  /* Set when blocks were split or added, not only instructions */
+  bool cfgChanged = false;
+
+  ValueInfo::RootID rootCount = 0;
+  std::vector<llvm::Value *> rootValues;
+  /* Whether the type of each root can carry a float; the users of the
+   * values descending from a float root are pruned by type */
+  std::vector<bool> rootIsFloat;
+  llvm::DenseMap<llvm::Type *, TypeSummary> typeSummaries;
+  llvm::StringSet<> allocationFunctions;
+  AnnotationProfileTable annotationProfiles;
+  /* Cross-module specialization: the calls to other modules seen, as
+   * "callee<TAB>signature", and the clones decided by the thin link, by the
+   * same key */
+  llvm::StringSet<> importRequests;
+  llvm::StringMap<std::string> thinLinkClones;
+  /* Streaming mode: the clones created by the function being processed,
+   * with their queues, waiting to be processed in turn */
+  std::vector<std::pair<llvm::Function *, std::unique_ptr<MultiValueMap<llvm::Value *, ValueInfo>>>> pendingQueues;
+  /* Annotations parsed so far, by annotation string; the same string is
+   * shared by all the annotations with the same text. Profile definitions
+   * have no metadata. */
+  llvm::DenseMap<llvm::GlobalVariable *, ParsedAnnotation> parsedAnnotations;
+  std::unique_ptr<ProvenanceLog> provenance;
+
+  uint64_t backtrackingVisits = 0;
+  llvm::DenseMap<ValueInfo::RootID, uint64_t> rootBacktrackingVisits;
+  llvm::SmallPtrSet<llvm::Value *, 8> cutOffRoots;
+  bool moduleBacktrackingBudgetExhausted = false;
+
+  llvm::DenseMap<const llvm::Function *, std::unique_ptr<llvm::OptimizationRemarkEmitter>> remarkEmitters;
+
+  /* The value info metadata attached by this run to each instruction, and
+   * copied with it into the clones. The clones are enqueued again from here
+   * rather than by decoding their metadata with the MetadataManager, whose
+   * cache is keyed by MDNode and outlives the run. */
+  llvm::DenseMap<const llvm::Instruction *, std::shared_ptr<mdutils::MDInfo>> attachedMetadata;
+
+  /* Position of each instruction in its function before the pass modified
+   * it, numbered on demand; used as a key stable across compilations */
+  llvm::DenseMap<const llvm::Instruction *, unsigned> instructionNumbers;
+  llvm::SmallPtrSet<const llvm::Function *, 16> numberedFunctions;
+
+  InitializerContext(llvm::Module &m, const TaffoInitializerOptions &opts)
+    : module(m), options(opts) {
+    for (const std::string& name: opts.allocationFunctions)
+      allocationFunctions.insert(name);
+  }
+};
+
+
+/* Values annotated in a module, found without modifying it */
+struct AnnotationIndex {
+  /* Annotated in llvm.global.annotations */
+  llvm::SmallVector<llvm::GlobalValue *, 8> annotatedGlobals;
+  /* Containing llvm.var.annotation calls */
+  llvm::SmallPtrSet<llvm::Function *, 8> annotatedFunctions;
+
+  static AnnotationIndex build(llvm::Module &m);
+  bool empty() const { return annotatedGlobals.empty() && annotatedFunctions.empty(); }
 };
 
 
@@ -43,31 +352,88 @@ struct TaffoInitializer : public llvm::ModulePass {
   
   using ConvQueueT = MultiValueMap<llvm::Value *, ValueInfo>;
   
-  llvm::SmallPtrSet<llvm::Function *, 32> enabledFunctions;
-  
-  TaffoInitializer(): ModulePass(ID) { }
+  TaffoInitializerOptions options;
+  std::unique_ptr<InitializerContext> ctx;
+  /* Set when the module is lazily loaded; function bodies are then
+   * materialized only when the pass needs them */
+  LazyFunctionMaterializer *materializer = nullptr;
+  /* When set, only the functions in the index are searched for local
+   * annotations */
+  const AnnotationIndex *annotationIndex = nullptr;
+
+  TaffoInitializer(): ModulePass(ID), options(TaffoInitializerOptions::fromCommandLine()) { }
+  TaffoInitializer(const TaffoInitializerOptions &opts): ModulePass(ID), options(opts) { }
   bool runOnModule(llvm::Module &M) override;
   
+  void writeDeclarations(llvm::Module &m);
+  ValueInfo::RootID newRoot(llvm::Value *v);
+  const TypeSummary& getTypeSummary(llvm::Type *t);
+  bool isFloatCarryingUser(llvm::Value *used, const ValueInfo& VIUsed, llvm::User *user);
+  bool chargeBacktracking(ValueInfo::RootID root, llvm::Instruction *inst);
+  llvm::OptimizationRemarkEmitter& getRemarkEmitter(const llvm::Function *f);
+  std::string getArgumentSignature(llvm::ArrayRef<llvm::Value *> args, ConvQueueT& vals);
+  int getCallbackArguments(llvm::CallSite *call, llvm::SmallVectorImpl<llvm::Value *>& actuals);
+  bool devirtualizeCall(llvm::CallSite *call, ConvQueueT& vals);
+  void collectPossibleCallees(llvm::Value *callee, llvm::SmallSetVector<llvm::Function *, 4>& res, unsigned depth = 0);
+  void logEnqueue(ProvenanceEdge kind, llvm::Value *src, llvm::Value *dst, const ValueInfo &vi) {
+    if (ctx->provenance)
+      ctx->provenance->logEdge(kind, src, dst, vi.root, vi.fixpTypeRootDistance);
+  }
+  
   void readGlobalAnnotations(llvm::Module &m, ConvQueueT& res, bool functionAnnotation = false);
   void readLocalAnnotations(llvm::Function &f, ConvQueueT& res);
   void readAllLocalAnnotations(llvm::Module &m, ConvQueueT& res);
   bool parseAnnotation(ConvQueueT& res, llvm::ConstantExpr *annoPtrInst, llvm::Value *instr, bool *isTarget = nullptr);
+  void readAnnotationProfiles(llvm::Module &m);
+  void addAnnotationRoot(ConvQueueT& res, llvm::Value *annotated, const ParsedAnnotation& ann, const llvm::DebugLoc& loc);
+  void readDatabaseAnnotations(llvm::Module &m, const AnnotationDatabase& db, ConvQueueT& global, ConvQueueT& local);
   void removeNoFloatTy(ConvQueueT& res);
+  void setConstantInitializerInfo(llvm::GlobalVariable *gv, ValueInfo& vi);
+  bool isNeverWritten(llvm::GlobalVariable *gv);
+  void tightenRangesFromConstants(ConvQueueT& vals);
+  void unifyLoopFormats(ConvQueueT& vals);
+  std::string getProfileKey(llvm::Value *v);
+  void instrumentRanges(llvm::Module &m, ConvQueueT& roots, ConvQueueT& vals);
+  void applyRangeProfile(ConvQueueT& roots);
   void printAnnotatedObj(llvm::Module &m);
+
+  std::string getCrossModuleSignature(llvm::ArrayRef<llvm::Value *> actuals, ConvQueueT& vals);
+  bool specializeAcrossModules(llvm::CallSite *call, llvm::Function *callee, llvm::ArrayRef<llvm::Value *> actuals, ConvQueueT& vals);
+  bool readThinLinkDecisions(llvm::Module &m);
+  void createExportedClones(llvm::Module &m, ConvQueueT& vals, ConvQueueT& global);
+  void writeModuleSummary(llvm::Module &m);
   
   void buildConversionQueueForRootValues(const ConvQueueT& val, ConvQueueT& res);
   void createInfoOfUser(llvm::Value *used, const ValueInfo& VIUsed, llvm::Value *user, ValueInfo& VIUser);
+  void propagateThroughMemTransfer(llvm::MemTransferInst *mt, llvm::Value *used, const ValueInfo& VIUsed, ConvQueueT& queue);
+  void propagateThroughAllocation(llvm::StoreInst *store, llvm::Value *used, const ValueInfo& VIUsed, ConvQueueT& queue);
+  ValueInfo& enqueueDerivedValue(llvm::Value *src, const ValueInfo& VISrc, llvm::Value *dst, ConvQueueT& queue, ProvenanceEdge kind);
+  llvm::CallSite getAllocationSite(llvm::Value *ptr, llvm::SmallVectorImpl<llvm::Value *> *casts = nullptr);
   std::shared_ptr<mdutils::MDInfo> extractGEPIMetadata(const llvm::Value *user,
 						       const llvm::Value *used,
 						       std::shared_ptr<mdutils::MDInfo> user_mdi,
 						       std::shared_ptr<mdutils::MDInfo> used_mdi);
   void generateFunctionSpace(ConvQueueT& vals, ConvQueueT& global, llvm::SmallPtrSet<llvm::Function *, 10> &callTrace);
-  llvm::Function *createFunctionAndQueue(llvm::CallSite *call, ConvQueueT& vals, ConvQueueT& global, std::vector<llvm::Value*> &convQueue);
+  void streamFunctionSpace(llvm::Module &m, ConvQueueT& vals, ConvQueueT& global);
+  llvm::Function *createFunctionAndQueue(llvm::CallSite *call, llvm::Function *oldF, llvm::ArrayRef<llvm::Value *> actuals, ConvQueueT& vals, ConvQueueT& cloneVals, ConvQueueT& global, std::vector<llvm::Value*> &convQueue);
+  llvm::Function *cloneFunctionAndQueue(llvm::Function *oldF, llvm::ArrayRef<llvm::Value *> actuals, llvm::ArrayRef<const ValueInfo *> argInfos, ConvQueueT& vals, ConvQueueT& global, std::vector<llvm::Value*> &convQueue);
+  void linkClone(llvm::Function *oldF, llvm::Function *newF);
+  bool mergeIdenticalClones(llvm::Module &m, llvm::SmallPtrSetImpl<llvm::Function *>& removed);
+  void cleanupClones(llvm::Module &m, ConvQueueT& vals);
   void printConversionQueue(ConvQueueT& vals);
   void removeAnnotationCalls(ConvQueueT& vals);
   
   void setMetadataOfValue(llvm::Value *v, ValueInfo& VI);
   void setFunctionArgsMetadata(llvm::Module &m, ConvQueueT& Q);
+  void setFunctionArgsMetadata(llvm::Function &f, ConvQueueT& Q);
+
+  void estimateConversion(llvm::Module &m, ConvQueueT& roots, ConvQueueT& global);
+  CloneCost estimateCloneCost(llvm::CallSite *call, ConvQueueT& vals, ConvQueueT& global, ConversionEstimate& est);
+  void printEstimate(llvm::raw_ostream& os, llvm::Module &m, ConversionEstimate& est);
+  bool isCloningCandidate(llvm::Function *f) {
+    return f && !isSpecialFunction(f) &&
+        (!options.manualFunctionCloning || ctx->enabledFunctions.count(f));
+  }
 
   bool isSpecialFunction(const llvm::Function* f) {
     llvm::StringRef fName = f->getName();
@@ -76,6 +442,37 @@ struct TaffoInitializer : public llvm::ModulePass {
 };
 
 
+/* New pass manager interface. The annotation index is a module analysis, so
+ * that it is computed once and shared by every query of the pipeline; the
+ * pass skips the modules without annotations, preserving every analysis,
+ * and otherwise preserves the CFG analyses unless a call was devirtualized
+ * and the function analyses unless the cleanup removed functions. */
+class TaffoAnnotationAnalysis : public llvm::AnalysisInfoMixin<TaffoAnnotationAnalysis> {
+  friend llvm::AnalysisInfoMixin<TaffoAnnotationAnalysis>;
+  static llvm::AnalysisKey Key;
+
+public:
+  using Result = AnnotationIndex;
+  Result run(llvm::Module &m, llvm::ModuleAnalysisManager &am);
+};
+
+
+class TaffoInitializerPass : public llvm::PassInfoMixin<TaffoInitializerPass> {
+public:
+  TaffoInitializerPass(): options(TaffoInitializerOptions::fromCommandLine()) { }
+  TaffoInitializerPass(const TaffoInitializerOptions &opts): options(opts) { }
+  llvm::PreservedAnalyses run(llvm::Module &m, llvm::ModuleAnalysisManager &am);
+
+private:
+  TaffoInitializerOptions options;
+};
+
+
+/* Make "taffoinit" available to the textual pipelines of pb and register
+ * the annotation analysis; also done by the pass plugin entry point */
+void registerTaffoInitializerPasses(llvm::PassBuilder &pb);
+
+
 }
 
 
@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+
+/* backtracking(true) is the same as backtracking without a depth: the
+ * operands of the annotated value are enqueued back to the loads of a and
+ * b, whatever their distance */
+float mix(float a, float b)
+{
+  float t = a * 0.25f + b * 0.75f;
+  float __attribute__((annotate("backtracking(true) scalar(range(-16, 16))"))) r = t * 2;
+  return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+  printf("%f\n", mix(argc, 3.0f));
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+#ifndef __TAFFO_BENCH_H__
+#define __TAFFO_BENCH_H__
+
+
+/* Shared harness of the kernels run by run-bench.sh.
+ * Each kernel takes the number of repetitions as its first argument, prints
+ *   <kernel> <elements> <nanoseconds>
+ * on stderr for the timed part, and its results one per line on stdout. */
+
+
+static uint64_t bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static int bench_reps(int argc, char *argv[])
+{
+  int reps = argc > 1 ? atoi(argv[1]) : 0;
+  return reps > 0 ? reps : 1000;
+}
+
+
+static void bench_report(const char *name, uint64_t elements, uint64_t start)
+{
+  uint64_t ns = bench_now() - start;
+  fprintf(stderr, "%s %llu %llu\n", name, (unsigned long long)elements, (unsigned long long)ns);
+}
+
+
+/* Deterministic inputs in [-1, 1), identical in both builds */
+static float bench_rand(uint32_t *state)
+{
+  *state = *state * 1664525u + 1013904223u;
+  return (float)(int32_t)*state / 2147483648.0f;
+}
+
+
+#endif // __TAFFO_BENCH_H__
@@ -0,0 +1,41 @@
+#include "bench.h"
+
+
+#define N 4096
+#define TAPS 32
+
+
+float __attribute__((annotate("scalar(range(-1, 1))"))) signal[N + TAPS];
+float __attribute__((annotate("scalar(range(-0.5, 0.5))"))) taps[TAPS];
+float __attribute__((annotate("target('fir') scalar(range(-16, 16))"))) filtered[N];
+
+
+static __attribute__((noinline)) void fir(void)
+{
+  for (int i = 0; i < N; i++) {
+    float acc = 0;
+    for (int j = 0; j < TAPS; j++)
+      acc += signal[i + j] * taps[j];
+    filtered[i] = acc;
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  int reps = bench_reps(argc, argv);
+  uint32_t seed = 1;
+  for (int i = 0; i < N + TAPS; i++)
+    signal[i] = bench_rand(&seed);
+  for (int j = 0; j < TAPS; j++)
+    taps[j] = bench_rand(&seed) / 2;
+
+  uint64_t start = bench_now();
+  for (int r = 0; r < reps; r++)
+    fir();
+  bench_report("fir", (uint64_t)reps * N, start);
+
+  for (int i = 0; i < N; i++)
+    printf("%.9g\n", filtered[i]);
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include "bench.h"
+
+
+#define ROWS 256
+#define COLS 256
+
+
+float __attribute__((annotate("scalar(range(-1, 1))"))) matrix[ROWS][COLS];
+float __attribute__((annotate("scalar(range(-1, 1))"))) vector[COLS];
+float __attribute__((annotate("target('gemv') scalar(range(-64, 64))"))) result[ROWS];
+
+
+static __attribute__((noinline)) void gemv(void)
+{
+  for (int i = 0; i < ROWS; i++) {
+    float acc = 0;
+    for (int j = 0; j < COLS; j++)
+      acc += matrix[i][j] * vector[j];
+    result[i] = acc;
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  int reps = bench_reps(argc, argv);
+  uint32_t seed = 2;
+  for (int i = 0; i < ROWS; i++)
+    for (int j = 0; j < COLS; j++)
+      matrix[i][j] = bench_rand(&seed);
+  for (int j = 0; j < COLS; j++)
+    vector[j] = bench_rand(&seed);
+
+  uint64_t start = bench_now();
+  for (int r = 0; r < reps; r++)
+    gemv();
+  bench_report("gemv", (uint64_t)reps * ROWS * COLS, start);
+
+  for (int i = 0; i < ROWS; i++)
+    printf("%.9g\n", result[i]);
+  return 0;
+}
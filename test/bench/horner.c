@@ -0,0 +1,48 @@
+#include "bench.h"
+
+
+#define N 8192
+
+
+/* Degree 7 polynomial approximation of sin(x) for x in [-1, 1], evaluated
+ * through a cloned helper */
+static const float coeffs[8] = {
+  0, 1, 0, -1.0f / 6, 0, 1.0f / 120, 0, -1.0f / 5040
+};
+
+float __attribute__((annotate("scalar(range(-1, 1))"))) x[N];
+float __attribute__((annotate("target('horner') scalar(range(-1, 1))"))) y[N];
+
+
+static __attribute__((noinline)) float poly(float v)
+{
+  float acc = coeffs[7];
+  for (int k = 6; k >= 0; k--)
+    acc = acc * v + coeffs[k];
+  return acc;
+}
+
+
+static __attribute__((noinline)) void horner(void)
+{
+  for (int i = 0; i < N; i++)
+    y[i] = poly(x[i]);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int reps = bench_reps(argc, argv);
+  uint32_t seed = 3;
+  for (int i = 0; i < N; i++)
+    x[i] = bench_rand(&seed);
+
+  uint64_t start = bench_now();
+  for (int r = 0; r < reps; r++)
+    horner();
+  bench_report("horner", (uint64_t)reps * N, start);
+
+  for (int i = 0; i < N; i++)
+    printf("%.9g\n", y[i]);
+  return 0;
+}
@@ -0,0 +1,144 @@
+#!/bin/bash
+# End-to-end benchmark of the TAFFO conversion of the kernels in this
+# directory against their float originals.
+#
+# usage: run-bench.sh [-r reps] [-o outdir] [-c previous-report] [kernel...]
+#
+# Each kernel is built twice: with clang -O3 as is, and through this
+# initializer (taffo-init) followed by the rest of the TAFFO pipeline given
+# in TAFFO_PASSES, e.g.
+#   TAFFO_PASSES="-load TaffoVRA.so -taffoVRA -load TaffoDTA.so -taffodta
+#                 -load LLVMFloatToFixed.so -flttofix -dce"
+# Both builds are run and compared: throughput, instructions per element
+# (when perf is available) and maximum absolute error of the results, which
+# must be within the bound of the kernel. With -c, the report is compared
+# with a previous one, and a converted kernel whose throughput dropped by
+# more than TOLERANCE (default 0.1) is reported as a regression.
+#
+# Environment: CLANG, OPT, TAFFO_INIT (path of the taffo-init tool),
+# TAFFO_PASSES, TOLERANCE.
+
+set -u
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CLANG=${CLANG:-clang}
+OPT=${OPT:-opt}
+TAFFO_INIT=${TAFFO_INIT:-taffo-init}
+TOLERANCE=${TOLERANCE:-0.1}
+
+# Maximum absolute error of the converted kernels
+declare -A BOUND=(
+  [fir]=1e-2
+  [gemv]=5e-2
+  [horner]=1e-3
+)
+
+REPS=1000
+OUT=bench-out
+PREVIOUS=
+while getopts "r:o:c:" opt; do
+  case $opt in
+    r) REPS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    c) PREVIOUS=$OPTARG ;;
+    *) exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+KERNELS=("$@")
+if [ ${#KERNELS[@]} -eq 0 ]; then
+  KERNELS=($(printf "%s\n" "${!BOUND[@]}" | sort))
+fi
+if [ -z "${TAFFO_PASSES:-}" ]; then
+  echo "run-bench.sh: TAFFO_PASSES must list the opt arguments of the TAFFO passes following the initializer" >&2
+  exit 2
+fi
+mkdir -p "$OUT"
+
+HAVE_PERF=0
+if command -v perf > /dev/null && perf stat -x, -e instructions true > /dev/null 2>&1; then
+  HAVE_PERF=1
+fi
+
+
+build()
+{
+  local k=$1
+  "$CLANG" -O3 "$BENCH_DIR/$k.c" -o "$OUT/$k.float" || return 1
+  "$CLANG" -O0 -Xclang -disable-O0-optnone -S -emit-llvm "$BENCH_DIR/$k.c" -o "$OUT/$k.ll" || return 1
+  "$TAFFO_INIT" -S -output-dir "$OUT" -declarations-out "$OUT/$k.declarations" "$OUT/$k.ll" || return 1
+  $OPT $TAFFO_PASSES -S "$OUT/$k.init.ll" -o "$OUT/$k.fix.ll" || return 1
+  "$CLANG" -O3 "$OUT/$k.fix.ll" -o "$OUT/$k.taffo" || return 1
+}
+
+
+# Prints "<elements per second> <instructions per element>" of a build and
+# writes its results to $OUT/<build>.out
+measure()
+{
+  local exe=$1
+  "$exe" "$REPS" > "$exe.out" 2> "$exe.time" || return 1
+  local mps
+  mps=$(awk '{ printf "%.1f", $2 / $3 * 1000 }' "$exe.time")
+
+  # Two runs with different repetitions, so that the setup and the output
+  # of the results cancel out
+  local ipe=n/a
+  if [ $HAVE_PERF -eq 1 ]; then
+    local i1 i2 e1
+    i1=$(perf stat -x, -e instructions "$exe" "$REPS" 2>&1 > /dev/null | awk -F, '/instructions/ { print $1 }')
+    e1=$(awk '{ print $2 }' "$exe.time")
+    i2=$(perf stat -x, -e instructions "$exe" $((REPS * 2)) 2>&1 > /dev/null | awk -F, '/instructions/ { print $1 }')
+    ipe=$(awk -v i1="$i1" -v i2="$i2" -v e="$e1" 'BEGIN { if (i1 > 0 && i2 > 0) printf "%.2f", (i2 - i1) / e; else print "n/a" }')
+  fi
+  echo "$mps $ipe"
+}
+
+
+FAILED=0
+REPORT="$OUT/report.txt"
+echo "# kernel float-Melem/s taffo-Melem/s speedup float-instr/elem taffo-instr/elem max-error bound status" > "$REPORT"
+for k in "${KERNELS[@]}"; do
+  if [ -z "${BOUND[$k]:-}" ]; then
+    echo "run-bench.sh: unknown kernel $k" >&2
+    FAILED=1
+    continue
+  fi
+  if ! build "$k"; then
+    echo "$k - - - - - - ${BOUND[$k]} build-failed" >> "$REPORT"
+    FAILED=1
+    continue
+  fi
+  read -r fmps fipe < <(measure "$OUT/$k.float")
+  read -r tmps tipe < <(measure "$OUT/$k.taffo")
+  if [ -z "${fmps:-}" ] || [ -z "${tmps:-}" ]; then
+    echo "$k - - - - - - ${BOUND[$k]} run-failed" >> "$REPORT"
+    FAILED=1
+    continue
+  fi
+
+  err=$(paste "$OUT/$k.float.out" "$OUT/$k.taffo.out" | awk '
+    { d = $1 - $2; if (d < 0) d = -d; if (d > m) m = d; n++ }
+    END { if (n == 0) print "nan"; else printf "%.3g", m }')
+  status=ok
+  if ! awk -v e="$err" -v b="${BOUND[$k]}" 'BEGIN { exit !(e != "nan" && e + 0 <= b + 0) }'; then
+    status=error-out-of-bounds
+    FAILED=1
+  fi
+  speedup=$(awk -v f="$fmps" -v t="$tmps" 'BEGIN { printf "%.2f", t / f }')
+  echo "$k $fmps $tmps $speedup $fipe $tipe $err ${BOUND[$k]} $status" >> "$REPORT"
+done
+
+if [ -n "$PREVIOUS" ]; then
+  if ! awk -v tol="$TOLERANCE" '
+      FNR == NR { if ($1 !~ /^#/) prev[$1] = $3; next }
+      $1 !~ /^#/ && ($1 in prev) && prev[$1] + 0 > 0 && $3 + 0 < prev[$1] * (1 - tol) {
+        printf "%s: converted throughput %s Melem/s, was %s\n", $1, $3, prev[$1] > "/dev/stderr"; bad = 1
+      }
+      END { exit bad }' "$PREVIOUS" "$REPORT"; then
+    FAILED=1
+  fi
+fi
+
+column -t "$REPORT" 2> /dev/null || cat "$REPORT"
+exit $FAILED
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Checks the clone cleanup on clone_merge.c: the two identical clones of
+# scale must be merged into one, called by both calls, and the clone chain
+# of scale (!taffo.equivalentChild) must list that clone exactly once.
+#
+# Environment: CLANG, TAFFO_INIT (path of the taffo-init tool).
+
+set -u
+
+TEST_DIR=$(cd "$(dirname "$0")" && pwd)
+CLANG=${CLANG:-clang}
+TAFFO_INIT=${TAFFO_INIT:-taffo-init}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+fail()
+{
+  echo "check-clone-merge.sh: $*" >&2
+  exit 1
+}
+
+"$CLANG" -O0 -Xclang -disable-O0-optnone -S -emit-llvm "$TEST_DIR/clone_merge.c" -o "$OUT/clone_merge.ll" || exit 2
+"$TAFFO_INIT" -S -output-dir "$OUT" -declarations-out "$OUT/declarations" "$OUT/clone_merge.ll" || exit 2
+IR="$OUT/clone_merge.init.ll"
+
+clones=$(grep -c '^define .*@scale\.[0-9]*(' "$IR")
+[ "$clones" -eq 1 ] || fail "$clones clones of scale left, expected 1"
+clone=$(grep -o '^define .*@scale\.[0-9]*(' "$IR" | grep -o '@scale\.[0-9]*')
+
+calls=$(grep -c "call .*$clone(" "$IR")
+[ "$calls" -eq 2 ] || fail "$calls calls to $clone, expected 2"
+
+chain=$(grep '^define .*@scale(' "$IR" | grep -o '!taffo.equivalentChild ![0-9]*' | grep -o '![0-9]*$')
+[ -n "$chain" ] || fail "scale has no clone chain"
+entries=$(grep "^$chain = " "$IR" | grep -o '@[A-Za-z0-9_.]*')
+[ "$entries" = "$clone" ] || fail "clone chain of scale is '$(echo $entries)', expected '$clone'"
+
+echo "check-clone-merge.sh: ok"
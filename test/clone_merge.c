@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+
+/* Not static, so that it is kept after the specialization and its chain of
+ * clones can be checked */
+void scale(float *v, int n, float k)
+{
+  for (int i = 0; i < n; i++)
+    v[i] *= k;
+}
+
+
+int main(int argc, char *argv[])
+{
+  float __attribute__((annotate("scalar(range(-8, 8))"))) a[4] = {1, 2, 3, 4};
+  float __attribute__((annotate("scalar(range(-8, 8))"))) b[4] = {4, 3, 2, 1};
+
+  /* Two calls with the same argument metadata: their clones are identical
+   * and must be merged into one */
+  scale(a, 4, 0.5f);
+  scale(b, 4, 0.5f);
+  printf("%f %f\n", a[0], b[0]);
+  return 0;
+}
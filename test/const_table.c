@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+
+static const float __attribute__((annotate("scalar(range(-0.05, 0.5))"))) coeffs[8] = {
+  0.0125, -0.0431, 0.1175, 0.4131, 0.4131, 0.1175, -0.0431, 0.0125
+};
+
+
+int main(int argc, char *argv[])
+{
+  float __attribute__((annotate("range -1 1"))) x[8] = {0};
+  float acc = 0;
+  for (int i = 0; i < 8; i++) {
+    x[i] = (float)i / 8;
+    acc += coeffs[i] * x[i];
+  }
+  printf("%f\n", acc);
+  return 0;
+}
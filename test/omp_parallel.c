@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+
+#define N 1024
+
+
+int main(int argc, char *argv[])
+{
+  float __attribute__((annotate("range -1 1"))) a[N];
+  float __attribute__((annotate("range 0 2"))) k = 1.5;
+  float b[N];
+
+  for (int i = 0; i < N; i++)
+    a[i] = (float)(i - N / 2) / N;
+
+  #pragma omp parallel for
+  for (int i = 0; i < N; i++)
+    b[i] = a[i] * k;
+
+  printf("%f %f\n", b[0], b[N - 1]);
+  return 0;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+
+
+static char __attribute__((used, annotate("define_profile('sample') scalar(range(-1, 1) type(16 14) error(1e-4))")))
+    sample_profile;
+static char __attribute__((used, annotate("define_profile('gain') scalar(range(0, 16))")))
+    gain_profile;
+
+
+struct channel {
+  float sample;
+  float gain;
+};
+
+
+int main(int argc, char *argv[])
+{
+  float __attribute__((annotate("profile('sample')"))) in[16];
+  float __attribute__((annotate("target('out') profile('sample')"))) out[16];
+  struct channel __attribute__((annotate("struct[profile('sample'), profile('gain')]"))) ch = {0.5, 2};
+
+  for (int i = 0; i < 16; i++) {
+    in[i] = (float)(i - 8) / 16;
+    out[i] = in[i] * ch.sample * ch.gain / 16;
+  }
+  printf("%f\n", out[15]);
+  return 0;
+}
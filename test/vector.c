@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+
+typedef float float4 __attribute__((ext_vector_type(4)));
+
+
+float4 scale(float4 v, float k)
+{
+  float4 kv = (float4){k, k, k, k};
+  return v * kv;
+}
+
+
+int main(int argc, char *argv[])
+{
+  float4 __attribute__((annotate("range -128 128"))) a = {1.5, -2.25, 3.0, 0.125};
+  float __attribute__((annotate("range 0 4"))) k = 2.0;
+  float4 b = scale(a, k);
+  float sum = b.x + b.y + b.z + b.w;
+  b.w = sum;
+  printf("%f %f %f %f\n", b.x, b.y, b.z, b.w);
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "AnnotationDatabase.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+/* Builds the annotation database read by -taffo-init-annotation-db from a
+ * text file with one annotation per line:
+ *   <key> <annotation>
+ * where the key is @name, function:var or function@line and the annotation
+ * uses the same grammar as the annotate() attributes. Empty lines and lines
+ * starting with # are ignored. The profiles referenced with profile('name')
+ * are read from the file given with -profiles and resolved when the database
+ * is built. */
+
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<annotation list>"));
+static cl::opt<std::string> OutputFile("o", cl::Required, cl::value_desc("filename"), cl::desc("Output database"));
+static cl::opt<std::string> ProfilesFile("profiles", cl::value_desc("filename"), cl::desc("Annotation profile definitions"));
+
+
+int main(int argc, char **argv)
+{
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "TAFFO initializer annotation database builder\n");
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFileOrSTDIN(InputFile);
+  if (!buf) {
+    errs() << "taffo-init-annotation-db: " << InputFile << ": " << buf.getError().message() << "\n";
+    return 1;
+  }
+
+  AnnotationProfileTable profiles;
+  std::string err;
+  if (!ProfilesFile.empty() && !profiles.readFile(ProfilesFile, err)) {
+    errs() << "taffo-init-annotation-db: " << err << "\n";
+    return 1;
+  }
+
+  AnnotationDatabaseBuilder builder;
+  bool failed = false;
+  for (line_iterator line(**buf, true, '#'); !line.is_at_eof(); ++line) {
+    std::pair<StringRef, StringRef> fields = line->trim().split(' ');
+    StringRef key = fields.first;
+    StringRef annotation = fields.second.trim();
+    if (annotation.empty()) {
+      errs() << InputFile << ":" << line.line_number() << ": missing annotation\n";
+      failed = true;
+      continue;
+    }
+
+    AnnotationParser parser(&profiles);
+    if (!parser.parseAnnotationString(annotation)) {
+      errs() << InputFile << ":" << line.line_number() << ": " << parser.lastError() << "\n";
+      failed = true;
+      continue;
+    }
+    if (!builder.add(key, parser)) {
+      errs() << InputFile << ":" << line.line_number() << ": duplicated key " << key << "\n";
+      failed = true;
+    }
+  }
+  if (failed)
+    return 1;
+
+  std::error_code ec;
+  raw_fd_ostream os(OutputFile, ec, sys::fs::F_None);
+  if (ec) {
+    errs() << "taffo-init-annotation-db: " << OutputFile << ": " << ec.message() << "\n";
+    return 1;
+  }
+  builder.write(os);
+  return 0;
+}
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+#include "ProvenanceLog.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+/* Summarizes a provenance log written by -taffo-init-provenance: which
+ * annotations and which functions contributed the most entries to the
+ * conversion queues. */
+
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<provenance log>"));
+static cl::opt<unsigned> Top("top", cl::desc("Number of roots and functions to report"), cl::init(20));
+
+
+namespace {
+
+struct RootStats {
+  uint32_t root = 0;
+  size_t enqueues = 0;
+  DenseSet<uint32_t> values;
+  unsigned maxDistance = 0;
+  size_t byKind[(int)ProvenanceEdge::NumEdgeKinds] = {};
+};
+
+struct FunctionStats {
+  uint32_t function = 0;
+  size_t enqueues = 0;
+  DenseMap<uint32_t, size_t> byRoot;
+};
+
+}
+
+
+int main(int argc, char **argv)
+{
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "TAFFO initializer provenance log query tool\n");
+
+  ProvenanceLogContents log;
+  std::string err;
+  if (!log.read(InputFile, err)) {
+    errs() << "taffo-init-provenance: " << InputFile << ": " << err << "\n";
+    return 1;
+  }
+
+  size_t byKind[(int)ProvenanceEdge::NumEdgeKinds] = {};
+  DenseMap<uint32_t, RootStats> roots;
+  DenseMap<uint32_t, FunctionStats> functions;
+  for (const ProvenanceLogContents::Edge& e: log.edges) {
+    unsigned kind = std::min((unsigned)e.kind, (unsigned)ProvenanceEdge::NumEdgeKinds - 1);
+    byKind[kind]++;
+
+    RootStats& rs = roots[e.root];
+    rs.root = e.root;
+    rs.enqueues++;
+    rs.values.insert(e.dst);
+    if (e.distance != UINT16_MAX)
+      rs.maxDistance = std::max<unsigned>(rs.maxDistance, e.distance);
+    rs.byKind[kind]++;
+
+    uint32_t func = e.dst < log.values.size() ? log.values[e.dst].function : 0;
+    FunctionStats& fs = functions[func];
+    fs.function = func;
+    fs.enqueues++;
+    fs.byRoot[e.root]++;
+  }
+
+  outs() << "enqueues: " << log.edges.size() << ", roots: " << log.roots.size() << "\n";
+  for (int k = 0; k < (int)ProvenanceEdge::NumEdgeKinds; k++) {
+    if (byKind[k])
+      outs() << "  " << getProvenanceEdgeName((ProvenanceEdge)k) << ": " << byKind[k] << "\n";
+  }
+
+  std::vector<RootStats *> sortedRoots;
+  for (auto& rs: roots)
+    sortedRoots.push_back(&rs.second);
+  std::sort(sortedRoots.begin(), sortedRoots.end(), [](RootStats *a, RootStats *b) {
+    return a->enqueues > b->enqueues || (a->enqueues == b->enqueues && a->root < b->root);
+  });
+  outs() << "\nlargest fan-outs per root:\n";
+  for (size_t i = 0; i < sortedRoots.size() && i < Top; i++) {
+    RootStats *rs = sortedRoots[i];
+    auto rootValue = log.roots.find(rs->root);
+    outs() << "  #" << rs->root << " "
+           << (rootValue != log.roots.end() ? log.describeValue(rootValue->second) : "<no root>")
+           << ": " << rs->enqueues << " enqueues, " << rs->values.size() << " values, max distance "
+           << rs->maxDistance << "\n";
+    outs() << "     ";
+    for (int k = 0; k < (int)ProvenanceEdge::NumEdgeKinds; k++) {
+      if (rs->byKind[k])
+        outs() << " " << getProvenanceEdgeName((ProvenanceEdge)k) << "=" << rs->byKind[k];
+    }
+    outs() << "\n";
+  }
+
+  std::vector<FunctionStats *> sortedFunctions;
+  for (auto& fs: functions)
+    sortedFunctions.push_back(&fs.second);
+  std::sort(sortedFunctions.begin(), sortedFunctions.end(), [](FunctionStats *a, FunctionStats *b) {
+    return a->enqueues > b->enqueues || (a->enqueues == b->enqueues && a->function < b->function);
+  });
+  outs() << "\nlargest fan-outs per function:\n";
+  for (size_t i = 0; i < sortedFunctions.size() && i < Top; i++) {
+    FunctionStats *fs = sortedFunctions[i];
+    uint32_t topRoot = 0;
+    size_t topCount = 0;
+    for (auto& r: fs->byRoot) {
+      if (r.second > topCount || (r.second == topCount && r.first < topRoot)) {
+        topRoot = r.first;
+        topCount = r.second;
+      }
+    }
+    outs() << "  " << (fs->function ? log.strings[fs->function] : "<globals>") << ": "
+           << fs->enqueues << " enqueues, mostly from root #" << topRoot
+           << " (" << topCount << ")\n";
+  }
+
+  return 0;
+}
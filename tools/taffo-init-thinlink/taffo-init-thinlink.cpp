@@ -0,0 +1,172 @@
+#include <deque>
+#include <map>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+using namespace llvm;
+
+
+/* Thin link step of the cross-module specialization: reads the summaries
+ * written by -taffo-init-summary-out for all the modules of a program and
+ * decides which clones each module defines, for the annotated calls to
+ * functions of other modules and, transitively, for the calls those
+ * functions make with the arguments they receive. The decisions are read
+ * back by every module with -taffo-init-thinlink-decisions. */
+
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore, cl::desc("<module summaries>"));
+static cl::opt<std::string> OutputFile("o", cl::Required, cl::value_desc("filename"), cl::desc("Output decisions"));
+
+
+namespace {
+
+struct ForwardedCall {
+  std::string callee;
+  /* Argument of the call, parameter of the caller */
+  std::vector<std::pair<unsigned, unsigned>> args;
+};
+
+}
+
+
+/* "i=annotation;..." <-> index -> annotation */
+static bool parseSignature(StringRef sig, std::map<unsigned, std::string>& res)
+{
+  SmallVector<StringRef, 8> args;
+  sig.split(args, ';');
+  for (StringRef arg: args) {
+    StringRef index, annotation;
+    std::tie(index, annotation) = arg.split('=');
+    unsigned i;
+    if (index.getAsInteger(10, i) || annotation.empty())
+      return false;
+    res[i] = annotation.str();
+  }
+  return true;
+}
+
+
+static std::string printSignature(const std::map<unsigned, std::string>& sig)
+{
+  std::string res;
+  for (auto& arg: sig) {
+    if (!res.empty())
+      res += ";";
+    res += std::to_string(arg.first) + "=" + arg.second;
+  }
+  return res;
+}
+
+
+int main(int argc, char **argv)
+{
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "TAFFO initializer cross-module specialization thin link\n");
+
+  StringMap<std::string> definedIn;
+  StringMap<std::vector<ForwardedCall>> forwarded;
+  std::deque<std::pair<std::string, std::string>> worklist;
+  bool failed = false;
+
+  for (const std::string& input: InputFiles) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(input);
+    if (!buf) {
+      errs() << "taffo-init-thinlink: " << input << ": " << buf.getError().message() << "\n";
+      failed = true;
+      continue;
+    }
+    std::string module = input;
+    for (line_iterator line(**buf, true, '#'); !line.is_at_eof(); ++line) {
+      SmallVector<StringRef, 4> fields;
+      line->split(fields, '\t');
+      if (fields[0] == "module" && fields.size() == 2) {
+        module = fields[1].str();
+      } else if (fields[0] == "def" && fields.size() == 2) {
+        auto ins = definedIn.insert(std::make_pair(fields[1], module));
+        if (!ins.second && ins.first->second != module)
+          errs() << "taffo-init-thinlink: " << fields[1] << " defined in " << ins.first->second
+                 << " and " << module << ", using the first\n";
+      } else if (fields[0] == "fwd" && fields.size() == 4) {
+        ForwardedCall call;
+        call.callee = fields[2].str();
+        SmallVector<StringRef, 8> pairs;
+        fields[3].split(pairs, ',');
+        for (StringRef pair: pairs) {
+          unsigned arg, param;
+          StringRef a, p;
+          std::tie(a, p) = pair.split('=');
+          if (!a.getAsInteger(10, arg) && !p.getAsInteger(10, param))
+            call.args.push_back(std::make_pair(arg, param));
+        }
+        forwarded[fields[1]].push_back(call);
+      } else if (fields[0] == "call" && fields.size() == 3) {
+        worklist.push_back(std::make_pair(fields[1].str(), fields[2].str()));
+      } else {
+        errs() << input << ":" << line.line_number() << ": malformed summary line\n";
+        failed = true;
+      }
+    }
+  }
+  if (failed)
+    return 1;
+
+  /* key -> clone name, sorted so that the output is deterministic */
+  std::map<std::string, std::string> decisions;
+  StringSet<> visited;
+  unsigned external = 0;
+  while (!worklist.empty()) {
+    std::string callee = worklist.front().first;
+    std::string sig = worklist.front().second;
+    worklist.pop_front();
+    std::string key = callee + "\t" + sig;
+    if (!visited.insert(key).second)
+      continue;
+    /* Library functions, or modules not part of the link */
+    if (!definedIn.count(callee)) {
+      external++;
+      continue;
+    }
+
+    MD5 hash;
+    hash.update(sig);
+    MD5::MD5Result digest;
+    hash.final(digest);
+    std::string clone;
+    raw_string_ostream(clone) << callee << ".taffo." << format_hex_no_prefix(digest.low(), 16);
+    decisions[key] = clone;
+
+    std::map<unsigned, std::string> args;
+    if (!parseSignature(sig, args))
+      continue;
+    for (const ForwardedCall& call: forwarded[callee]) {
+      std::map<unsigned, std::string> callArgs;
+      for (auto& arg: call.args) {
+        auto found = args.find(arg.second);
+        if (found != args.end())
+          callArgs[arg.first] = found->second;
+      }
+      if (!callArgs.empty())
+        worklist.push_back(std::make_pair(call.callee, printSignature(callArgs)));
+    }
+  }
+
+  std::error_code ec;
+  raw_fd_ostream os(OutputFile, ec, sys::fs::F_Text);
+  if (ec) {
+    errs() << "taffo-init-thinlink: " << OutputFile << ": " << ec.message() << "\n";
+    return 1;
+  }
+  for (auto& decision: decisions)
+    os << "clone\t" << decision.first << "\t" << decision.second << "\n";
+  errs() << decisions.size() << " clones decided, " << external << " call signatures to functions outside the link\n";
+  return 0;
+}
@@ -0,0 +1,290 @@
+#include <chrono>
+#include <fstream>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSummaryIndex.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TaffoInitializerPass.h"
+#include "LazyMaterialization.h"
+
+
+using namespace llvm;
+using namespace taffo;
+
+
+/* Batch driver for the TAFFO initializer.
+ * Every input module is parsed in its own LLVMContext and processed by its
+ * own TaffoInitializer instance, one module at a time: the metadata
+ * utilities keep process-wide state which is not scoped per run. The
+ * declarations and statistics of all the modules are aggregated in input
+ * order. */
+
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+    cl::desc("<input .bc/.ll files or @response-file>"));
+static cl::opt<std::string> OutputDir("output-dir", cl::value_desc("directory"),
+    cl::desc("Write the outputs in this directory instead of next to the inputs"));
+static cl::opt<std::string> OutputSuffix("output-suffix", cl::value_desc("suffix"),
+    cl::desc("Suffix appended to the stem of the output files"), cl::init(".init"));
+static cl::opt<bool> OutputAssembly("S", cl::desc("Write output as LLVM assembly"));
+static cl::opt<unsigned> Jobs("j", cl::value_desc("threads"), cl::Hidden,
+    cl::desc("Ignored; the modules are processed sequentially"), cl::init(1));
+static cl::opt<std::string> AggregateDeclarations("declarations-out", cl::value_desc("filename"),
+    cl::desc("Aggregated declarations of all the modules"), cl::init("declarations"));
+static cl::opt<std::string> StatsOut("stats-out", cl::value_desc("filename"),
+    cl::desc("Write a per-module statistics report to this file"));
+static cl::opt<bool> NoVerify("disable-verify", cl::desc("Do not verify the output modules"));
+static cl::opt<bool> LazyLoad("lazy",
+    cl::desc("Load bitcode lazily and materialize only the functions reachable from annotations"));
+
+
+namespace {
+
+struct ModuleReport {
+  std::string input;
+  std::string output;
+  bool failed = false;
+  std::string diagnostics;
+
+  unsigned annotationCount = 0;
+  unsigned functionCloned = 0;
+  size_t conversionQueueSize = 0;
+  unsigned lazilyMaterialized = 0;
+  unsigned backtrackingCutOffs = 0;
+  std::vector<std::string> declarations;
+  double seconds = 0;
+};
+
+}
+
+
+static std::string outputPathFor(StringRef input)
+{
+  SmallString<256> res;
+  if (OutputDir.empty())
+    res = sys::path::parent_path(input);
+  else
+    res = OutputDir;
+  std::string name = (sys::path::stem(input) + OutputSuffix + (OutputAssembly ? ".ll" : ".bc")).str();
+  sys::path::append(res, name);
+  return std::string(res.str());
+}
+
+
+/* Open a bitcode file without materializing any function body. The module
+ * summary, when present, tells which functions reference which globals. */
+static std::unique_ptr<Module> loadLazily(const std::string& input, LLVMContext& context,
+    std::unique_ptr<ModuleSummaryIndex>& summary, raw_ostream& diag)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(input);
+  if (!buf) {
+    diag << input << ": " << buf.getError().message() << "\n";
+    return nullptr;
+  }
+  const unsigned char *bufStart = (const unsigned char *)(*buf)->getBufferStart();
+  if (!isBitcode(bufStart, bufStart + (*buf)->getBufferSize()))
+    return nullptr;
+
+  MemoryBufferRef ref = (*buf)->getMemBufferRef();
+  Expected<BitcodeLTOInfo> ltoInfo = getBitcodeLTOInfo(ref);
+  if (!ltoInfo) {
+    consumeError(ltoInfo.takeError());
+  } else if (ltoInfo->HasSummary) {
+    Expected<std::unique_ptr<ModuleSummaryIndex>> index = getModuleSummaryIndex(ref);
+    if (index)
+      summary = std::move(*index);
+    else
+      consumeError(index.takeError());
+  }
+
+  Expected<std::unique_ptr<Module>> m = getOwningLazyBitcodeModule(std::move(*buf), context, true);
+  if (!m) {
+    logAllUnhandledErrors(m.takeError(), diag, input + ": ");
+    return nullptr;
+  }
+  return std::move(*m);
+}
+
+
+static void processModule(const TaffoInitializerOptions& opts, ModuleReport& report)
+{
+  auto start = std::chrono::steady_clock::now();
+  raw_string_ostream diag(report.diagnostics);
+
+  LLVMContext context;
+  std::unique_ptr<Module> m;
+  std::unique_ptr<ModuleSummaryIndex> summary;
+  std::unique_ptr<LazyFunctionMaterializer> materializer;
+  if (LazyLoad) {
+    m = loadLazily(report.input, context, summary, diag);
+    if (m)
+      materializer.reset(new LazyFunctionMaterializer(*m, summary.get()));
+  }
+  if (!m) {
+    SMDiagnostic err;
+    m = parseIRFile(report.input, err, context);
+    if (!m) {
+      err.print("taffo-init", diag);
+      report.failed = true;
+      return;
+    }
+  }
+
+  TaffoInitializer pass(opts);
+  pass.materializer = materializer.get();
+  pass.runOnModule(*m);
+  if (materializer)
+    report.lazilyMaterialized = materializer->getMaterializedCount();
+  InitializerContext& res = *pass.ctx;
+  report.annotationCount = res.annotationCount;
+  report.functionCloned = res.functionCloned;
+  report.conversionQueueSize = res.conversionQueueSize;
+  report.backtrackingCutOffs = res.cutOffRoots.size();
+  for (const DeclarationRecord& decl: res.declarations) {
+    report.declarations.push_back(decl.toString());
+  }
+
+  // Nothing to write, the module has not been modified
+  if (opts.estimateOnly) {
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return;
+  }
+
+  /* The bitcode writer needs all the bodies, so -lazy saves the time the
+   * pass would spend on the untouched functions, not the memory to load
+   * them */
+  if (materializer && !materializer->materializeAll()) {
+    report.failed = true;
+    return;
+  }
+
+  if (!NoVerify && verifyModule(*m, &diag)) {
+    diag << report.input << ": output module is broken\n";
+    report.failed = true;
+    return;
+  }
+
+  std::error_code ec;
+  ToolOutputFile out(report.output, ec, OutputAssembly ? sys::fs::F_Text : sys::fs::F_None);
+  if (ec) {
+    diag << report.output << ": " << ec.message() << "\n";
+    report.failed = true;
+    return;
+  }
+  if (OutputAssembly)
+    m->print(out.os(), nullptr);
+  else
+    WriteBitcodeToFile(*m, out.os());
+  out.keep();
+
+  report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+static void writeStats(raw_ostream& os, const std::vector<ModuleReport>& reports)
+{
+  unsigned annotations = 0, clones = 0, decls = 0, materialized = 0, cutoffs = 0, failures = 0;
+  size_t queue = 0;
+  double seconds = 0;
+
+  os << "# module annotations clones queue declarations materialized bt-cutoffs seconds\n";
+  for (const ModuleReport& r: reports) {
+    if (r.failed) {
+      os << r.input << " FAILED\n";
+      failures++;
+      continue;
+    }
+    os << r.input << " " << r.annotationCount << " " << r.functionCloned << " "
+       << r.conversionQueueSize << " " << r.declarations.size() << " "
+       << r.lazilyMaterialized << " " << r.backtrackingCutOffs << " "
+       << format("%.3f", r.seconds) << "\n";
+    annotations += r.annotationCount;
+    clones += r.functionCloned;
+    queue += r.conversionQueueSize;
+    decls += r.declarations.size();
+    materialized += r.lazilyMaterialized;
+    cutoffs += r.backtrackingCutOffs;
+    seconds += r.seconds;
+  }
+  os << "# total " << reports.size() << " modules, " << failures << " failed\n";
+  os << "total " << annotations << " " << clones << " " << queue << " " << decls << " "
+     << materialized << " " << cutoffs << " " << format("%.3f", seconds) << "\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "TAFFO initializer batch driver\n");
+
+  TaffoInitializerOptions opts = TaffoInitializerOptions::fromCommandLine();
+  // Declarations are aggregated by the driver
+  opts.declarationsFile = "";
+
+  if (!OutputDir.empty()) {
+    if (std::error_code ec = sys::fs::create_directories(OutputDir)) {
+      errs() << "taffo-init: cannot create " << OutputDir << ": " << ec.message() << "\n";
+      return 1;
+    }
+  }
+
+  std::vector<ModuleReport> reports(InputFiles.size());
+  StringMap<std::string> outputs;
+  bool collision = false;
+  for (size_t i = 0; i < InputFiles.size(); i++) {
+    reports[i].input = InputFiles[i];
+    reports[i].output = outputPathFor(InputFiles[i]);
+    /* The output name keeps only the stem of the input */
+    auto ins = outputs.insert(std::make_pair(reports[i].output, reports[i].input));
+    if (!ins.second) {
+      errs() << "taffo-init: " << ins.first->second << " and " << reports[i].input
+             << " would both be written to " << reports[i].output << "\n";
+      collision = true;
+    }
+  }
+  if (collision)
+    return 1;
+
+  if (Jobs != 1)
+    errs() << "taffo-init: -j is ignored, the modules are processed sequentially\n";
+  for (ModuleReport& r: reports)
+    processModule(opts, r);
+
+  bool failed = false;
+  for (const ModuleReport& r: reports) {
+    errs() << r.diagnostics;
+    failed |= r.failed;
+  }
+
+  if (!AggregateDeclarations.empty()) {
+    std::ofstream declarationsFile(AggregateDeclarations, std::ios_base::trunc);
+    for (const ModuleReport& r: reports)
+      for (const std::string& decl: r.declarations)
+        declarationsFile << decl << std::endl;
+  }
+
+  if (!StatsOut.empty()) {
+    std::error_code ec;
+    raw_fd_ostream os(StatsOut, ec, sys::fs::F_Text);
+    if (ec) {
+      errs() << "taffo-init: " << StatsOut << ": " << ec.message() << "\n";
+      return 1;
+    }
+    writeStats(os, reports);
+  }
+
+  return failed ? 1 : 0;
+}